@@ -1,5 +1,1031 @@
 #include <aconcurrent.h>
+#include <deque>
+#include <climits>
 
 using namespace AConcurrent;
 
-QMap<QString, QFuture<void>> AConcurrent::Private::debounceStore;
+Private::DebounceStore AConcurrent::Private::debounceStore;
+
+static QEvent::Type dispatchEventType() {
+    static QEvent::Type type = (QEvent::Type) QEvent::registerEventType();
+    return type;
+}
+
+Private::Dispatcher::Dispatcher() : redispatching(false) {
+}
+
+Private::Dispatcher *Private::Dispatcher::instance() {
+    static Dispatcher* dispatcher = []() {
+        Dispatcher* object = new Dispatcher();
+        object->moveToThread(QCoreApplication::instance()->thread());
+        return object;
+    }();
+
+    return dispatcher;
+}
+
+void Private::Dispatcher::post(std::function<void ()> func) {
+    // Only the first function after the queue is drained needs to wake up the main thread
+    if (queue.push(func)) {
+        QCoreApplication::postEvent(this, new QEvent(dispatchEventType()));
+    }
+}
+
+bool Private::Dispatcher::event(QEvent *event) {
+    if (event->type() != dispatchEventType()) {
+        return QObject::event(event);
+    }
+
+    redispatching = false;
+    queue.consume([this](const std::function<void()>& func) {
+        drained.push_back(func);
+    });
+
+    while (!drained.empty()) {
+        std::function<void()> func = std::move(drained.front());
+        drained.pop_front();
+
+        // The function may nest an event loop. Let the nested loop continue with the rest.
+        if (!drained.empty() && !redispatching) {
+            redispatching = true;
+            QCoreApplication::postEvent(this, new QEvent(dispatchEventType()));
+        }
+
+        func();
+    }
+
+    return true;
+}
+
+Private::DebounceStore::DebounceStore() {
+}
+
+QFuture<void> Private::DebounceStore::replace(const DebounceKey &key, QFuture<void> future) {
+    Shard& shard = shardOf(key);
+    QFuture<void> previous;
+    bool watch = false;
+    {
+        QMutexLocker locker(&shard.mutex);
+        if (key.object != nullptr && !shard.watched.contains(key.object)) {
+            shard.watched.insert(key.object);
+            watch = true;
+        }
+
+        QFuture<void>& entry = shard.futures[key];
+        previous = entry;
+        entry = future;
+    }
+
+    if (watch) {
+        // Direct connection. It is executed on the thread destroying the object.
+        QObject* object = key.object;
+        QObject::connect(object, &QObject::destroyed, [this, &shard, object]() {
+            QList<QFuture<void>> canceled = purge(shard, object);
+            for (int i = 0 ; i < canceled.size() ; i++) {
+                canceled[i].cancel();
+            }
+        });
+    }
+
+    return previous;
+}
+
+bool Private::DebounceStore::isCurrent(const DebounceKey &key, const QFuture<void> &future) const {
+    const Shard& shard = shardOf(key);
+    QMutexLocker locker(&shard.mutex);
+    auto iter = shard.futures.constFind(key);
+    return iter != shard.futures.constEnd() && iter.value() == future;
+}
+
+void Private::DebounceStore::remove(const DebounceKey &key, const QFuture<void> &future) {
+    Shard& shard = shardOf(key);
+    QMutexLocker locker(&shard.mutex);
+    auto iter = shard.futures.find(key);
+    if (iter != shard.futures.end() && iter.value() == future) {
+        shard.futures.erase(iter);
+    }
+}
+
+void Private::DebounceStore::purge(QObject *object) {
+    QList<QFuture<void>> canceled;
+
+    for (int i = 0 ; i < ShardCount ; i++) {
+        canceled << purge(shards[i], object);
+    }
+
+    // Cancel outside of the locks. It may trigger the cleanup of debounce() immediately.
+    for (int i = 0 ; i < canceled.size() ; i++) {
+        canceled[i].cancel();
+    }
+}
+
+QList<QFuture<void>> Private::DebounceStore::purge(Shard &shard, QObject *object) {
+    QList<QFuture<void>> canceled;
+
+    QMutexLocker locker(&shard.mutex);
+    shard.watched.remove(object);
+    auto iter = shard.futures.begin();
+    while (iter != shard.futures.end()) {
+        if (iter.key().object == object) {
+            canceled << iter.value();
+            iter = shard.futures.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+    return canceled;
+}
+
+int Private::DebounceStore::size() const {
+    int res = 0;
+    for (int i = 0 ; i < ShardCount ; i++) {
+        QMutexLocker locker(&shards[i].mutex);
+        res += shards[i].futures.size();
+    }
+    return res;
+}
+
+namespace {
+    // The stripe of MetricsCollector used by the current thread
+    QAtomicInt stripeCounter;
+
+    thread_local int currentStripe = -1;
+}
+
+Private::MetricsCollector::MetricsCollector() {
+    clock.start();
+}
+
+void Private::MetricsCollector::enqueued(int count) {
+    local().enqueued.fetchAndAddRelaxed(count);
+}
+
+void Private::MetricsCollector::dispatched(int count, qint64 waitTime) {
+    Stripe& stripe = local();
+    stripe.dispatched.fetchAndAddRelaxed(count);
+    stripe.waitTime.fetchAndAddRelaxed(waitTime);
+}
+
+void Private::MetricsCollector::executed(int count, qint64 elapsed) {
+    if (count <= 0) {
+        return;
+    }
+
+    qint64 usec = elapsed / count / 1000;
+    int bucket = 0;
+    while (bucket < Metrics::HistogramSize - 1 && (Q_INT64_C(1) << bucket) <= usec) {
+        bucket++;
+    }
+    local().histogram[bucket].fetchAndAddRelaxed(count);
+}
+
+void Private::MetricsCollector::finished(int count, qint64 latency) {
+    Stripe& stripe = local();
+    stripe.completed.fetchAndAddRelaxed(count);
+    stripe.tasks.fetchAndAddRelaxed(1);
+    stripe.latency.fetchAndAddRelaxed(latency);
+}
+
+void Private::MetricsCollector::hedged() {
+    local().hedged.fetchAndAddRelaxed(1);
+}
+
+void Private::MetricsCollector::hedgeWon() {
+    local().hedgeWins.fetchAndAddRelaxed(1);
+}
+
+Metrics Private::MetricsCollector::snapshot() const {
+    Metrics res;
+    qint64 enqueued = 0;
+    qint64 dispatched = 0;
+
+    for (int i = 0 ; i < StripeCount ; i++) {
+        const Stripe& stripe = stripes[i];
+        enqueued += stripe.enqueued.loadAcquire();
+        dispatched += stripe.dispatched.loadAcquire();
+        res.totalWaitTime += stripe.waitTime.loadAcquire();
+        res.completed += stripe.completed.loadAcquire();
+        res.finishedTasks += stripe.tasks.loadAcquire();
+        res.totalDispatchLatency += stripe.latency.loadAcquire();
+        res.hedged += stripe.hedged.loadAcquire();
+        res.hedgeWins += stripe.hedgeWins.loadAcquire();
+        for (int j = 0 ; j < Metrics::HistogramSize ; j++) {
+            res.executionTimeHistogram[j] += stripe.histogram[j].loadAcquire();
+        }
+    }
+
+    // Counters are read one by one, so they may be slightly out of sync while items are running
+    res.queued = qMax<qint64>(enqueued - dispatched, 0);
+    res.running = qMax<qint64>(dispatched - res.completed, 0);
+    res.elapsed = now();
+    return res;
+}
+
+Private::MetricsCollector::Stripe &Private::MetricsCollector::local() {
+    if (currentStripe < 0) {
+        currentStripe = stripeCounter.fetchAndAddRelaxed(1) % StripeCount;
+    }
+    return stripes[currentStripe];
+}
+
+Private::TimerWheel::TimerWheel() : current(0), nextId(0), wakeTick(-1), scheduling(false), timerId(0) {
+    clock.start();
+}
+
+Private::TimerWheel *Private::TimerWheel::instance() {
+    static TimerWheel* wheel = []() {
+        TimerWheel* object = new TimerWheel();
+        object->moveToThread(QCoreApplication::instance()->thread());
+        return object;
+    }();
+
+    return wheel;
+}
+
+qint64 Private::TimerWheel::start(int msec, std::function<void ()> callback) {
+    bool reschedule;
+    qint64 id;
+    {
+        QMutexLocker locker(&mutex);
+        id = ++nextId;
+        reschedule = startLocked(id, msec, callback);
+    }
+
+    if (reschedule) {
+        requestSchedule();
+    }
+    return id;
+}
+
+bool Private::TimerWheel::cancel(qint64 id) {
+    QMutexLocker locker(&mutex);
+    // The entry in the wheel is dropped lazily once its slot is reached
+    return callbacks.remove(id) > 0;
+}
+
+void Private::TimerWheel::debounce(const DebounceKey &key, int msec, std::function<void ()> callback) {
+    watch(key.object);
+
+    bool reschedule;
+    {
+        QMutexLocker locker(&mutex);
+        KeyedTimer& entry = keyed[key];
+        if (entry.id > 0) {
+            callbacks.remove(entry.id);
+        }
+
+        qint64 id = ++nextId;
+        entry.id = id;
+
+        reschedule = startLocked(id, msec, [this, key, id, callback]() {
+            {
+                QMutexLocker locker(&mutex);
+                auto iter = keyed.find(key);
+                if (iter == keyed.end() || iter->id != id) {
+                    return;
+                }
+                keyed.erase(iter);
+            }
+            callback();
+        });
+    }
+
+    if (reschedule) {
+        requestSchedule();
+    }
+}
+
+void Private::TimerWheel::throttle(const DebounceKey &key, int msec, std::function<void ()> callback) {
+    watch(key.object);
+
+    bool reschedule;
+    {
+        QMutexLocker locker(&mutex);
+        auto iter = keyed.find(key);
+        if (iter != keyed.end()) {
+            iter->trailing = callback;
+            return;
+        }
+
+        qint64 id = ++nextId;
+        KeyedTimer entry;
+        entry.id = id;
+        keyed.insert(key, entry);
+        reschedule = startLocked(id, msec, throttleWindow(key, id, msec));
+    }
+
+    if (reschedule) {
+        requestSchedule();
+    }
+
+    if (QThread::currentThread() == thread()) {
+        callback();
+    } else {
+        runOnMainThreadVoid(callback);
+    }
+}
+
+int Private::TimerWheel::size() const {
+    QMutexLocker locker(&mutex);
+    return callbacks.size();
+}
+
+void Private::TimerWheel::timerEvent(QTimerEvent *event) {
+    if (event->timerId() != timerId) {
+        QObject::timerEvent(event);
+        return;
+    }
+
+    QList<std::function<void()>> expired;
+    {
+        QMutexLocker locker(&mutex);
+        advance(now(), expired);
+    }
+
+    for (int i = 0 ; i < expired.size() ; i++) {
+        expired[i]();
+    }
+
+    schedule();
+}
+
+qint64 Private::TimerWheel::now() const {
+    return clock.elapsed();
+}
+
+bool Private::TimerWheel::startLocked(qint64 id, int msec, std::function<void ()> callback) {
+    if (callbacks.isEmpty()) {
+        // The wheel is idle. Drop the canceled entries and jump to now instead of walking through the idle ticks.
+        for (int level = 0 ; level < LevelCount ; level++) {
+            for (int i = 0 ; i < SlotCount ; i++) {
+                wheel[level][i].clear();
+            }
+        }
+        current = now();
+    }
+
+    Timer timer;
+    timer.id = id;
+    // The slot of the current tick is processed already
+    timer.deadline = qMax(now() + qMax(msec, 0), current + 1);
+
+    callbacks.insert(id, callback);
+    insert(timer);
+
+    return wakeTick < 0 || timer.deadline < wakeTick;
+}
+
+void Private::TimerWheel::insert(const Timer &timer) {
+    qint64 delta = timer.deadline - current;
+
+    for (int level = 0 ; level < LevelCount ; level++) {
+        if (delta < (Q_INT64_C(1) << (SlotBits * (level + 1)))) {
+            wheel[level][(timer.deadline >> (SlotBits * level)) & SlotMask].append(timer);
+            return;
+        }
+    }
+
+    // Beyond the range of the wheel. Park it in the farthest slot, it is inserted again when the slot is cascaded.
+    int level = LevelCount - 1;
+    wheel[level][((current >> (SlotBits * level)) + SlotMask) & SlotMask].append(timer);
+}
+
+void Private::TimerWheel::cascade(int level) {
+    int index = (current >> (SlotBits * level)) & SlotMask;
+    if (index == 0 && level + 1 < LevelCount) {
+        cascade(level + 1);
+    }
+
+    QVector<Timer> timers;
+    timers.swap(wheel[level][index]);
+
+    for (int i = 0 ; i < timers.size() ; i++) {
+        if (callbacks.contains(timers[i].id)) {
+            insert(timers[i]);
+        }
+    }
+}
+
+void Private::TimerWheel::advance(qint64 target, QList<std::function<void ()> > &expired) {
+    while (current < target && !callbacks.isEmpty()) {
+        current++;
+
+        int index = current & SlotMask;
+        if (index == 0) {
+            cascade(1);
+        }
+
+        QVector<Timer> timers;
+        timers.swap(wheel[0][index]);
+
+        for (int i = 0 ; i < timers.size() ; i++) {
+            const Timer& timer = timers[i];
+            auto iter = callbacks.find(timer.id);
+            if (iter == callbacks.end()) {
+                continue;
+            }
+
+            if (timer.deadline > current) {
+                insert(timer);
+            } else {
+                expired << iter.value();
+                callbacks.erase(iter);
+            }
+        }
+    }
+}
+
+qint64 Private::TimerWheel::nextWake() const {
+    if (callbacks.isEmpty()) {
+        return -1;
+    }
+
+    // The earliest non-empty slot of all the levels. A slot of a higher level is due at the tick it is cascaded, so the timer
+    // only wakes up there instead of at every rotation of the lower levels.
+    qint64 res = -1;
+    for (int level = 0 ; level < LevelCount ; level++) {
+        int shift = SlotBits * level;
+        qint64 position = current >> shift;
+        for (qint64 slot = position + 1 ; slot < position + SlotCount ; slot++) {
+            if (!wheel[level][slot & SlotMask].isEmpty()) {
+                qint64 tick = slot << shift;
+                if (res < 0 || tick < res) {
+                    res = tick;
+                }
+                break;
+            }
+        }
+    }
+
+    // A pending timer is always in a slot ahead of the current one, so it is only a guard
+    Q_ASSERT(res >= 0);
+    return res >= 0 ? res : current + 1;
+}
+
+void Private::TimerWheel::schedule() {
+    qint64 wake;
+    {
+        QMutexLocker locker(&mutex);
+        scheduling = false;
+        wake = nextWake();
+        wakeTick = wake;
+    }
+
+    if (timerId != 0) {
+        killTimer(timerId);
+        timerId = 0;
+    }
+
+    if (wake >= 0) {
+        timerId = startTimer((int) qMax<qint64>(wake - now(), 0), Qt::PreciseTimer);
+    }
+}
+
+void Private::TimerWheel::requestSchedule() {
+    if (QThread::currentThread() == thread()) {
+        schedule();
+        return;
+    }
+
+    {
+        QMutexLocker locker(&mutex);
+        if (scheduling) {
+            return;
+        }
+        scheduling = true;
+    }
+
+    runOnMainThreadVoid([this]() {
+        schedule();
+    });
+}
+
+std::function<void ()> Private::TimerWheel::throttleWindow(const DebounceKey &key, qint64 id, int msec) {
+    return [this, key, id, msec]() {
+        std::function<void()> trailing;
+        bool reschedule;
+        {
+            QMutexLocker locker(&mutex);
+            auto iter = keyed.find(key);
+            if (iter == keyed.end() || iter->id != id) {
+                return;
+            }
+
+            if (!iter->trailing) {
+                keyed.erase(iter);
+                return;
+            }
+
+            // Run the last dropped call and start another period
+            trailing = iter->trailing;
+            iter->trailing = nullptr;
+            qint64 next = ++nextId;
+            iter->id = next;
+            reschedule = startLocked(next, msec, throttleWindow(key, next, msec));
+        }
+
+        if (reschedule) {
+            requestSchedule();
+        }
+        trailing();
+    };
+}
+
+void Private::TimerWheel::watch(QObject *object) {
+    if (object == nullptr) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&mutex);
+        if (watched.contains(object)) {
+            return;
+        }
+        watched.insert(object);
+    }
+
+    QObject::connect(object, &QObject::destroyed, [this, object]() {
+        purge(object);
+    });
+}
+
+void Private::TimerWheel::purge(QObject *object) {
+    QMutexLocker locker(&mutex);
+    watched.remove(object);
+
+    auto iter = keyed.begin();
+    while (iter != keyed.end()) {
+        if (iter.key().object == object) {
+            callbacks.remove(iter->id);
+            iter = keyed.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+}
+
+namespace {
+
+    // The pool running the current thread if it is started by ThreadPoolExecutor
+    thread_local QThreadPool* currentPool = nullptr;
+
+    class FunctionRunnable : public QRunnable {
+    public:
+        FunctionRunnable(std::function<void()> function, QThreadPool* pool = nullptr) : function(function), pool(pool) {
+        }
+
+        void run() override {
+            QThreadPool* previous = currentPool;
+            currentPool = pool;
+            function();
+            currentPool = previous;
+        }
+
+    private:
+        std::function<void()> function;
+        QThreadPool* pool;
+    };
+
+    // The scheduler and the index of the worker thread running on the current thread
+    thread_local const void* currentScheduler = nullptr;
+
+    thread_local int currentIndex = -1;
+
+}
+
+void ThreadPoolExecutor::start(std::function<void ()> function, int priority) {
+    QThreadPool* target = pool ? pool.data() : QThreadPool::globalInstance();
+    target->start(new FunctionRunnable(function, target), priority);
+}
+
+int ThreadPoolExecutor::maxThreadCount() const {
+    QThreadPool* target = pool ? pool.data() : QThreadPool::globalInstance();
+    return target->maxThreadCount();
+}
+
+namespace AConcurrent {
+    namespace Private {
+
+        // WorkStealingScheduler owns the threads and the per-thread deques of WorkStealingExecutor
+        class WorkStealingScheduler {
+        public:
+            class Deque {
+            public:
+                void push(const std::function<void()>& function) {
+                    QMutexLocker locker(&mutex);
+                    functions.push_back(function);
+                }
+
+                /// Take the newest function, which is likely still in the cache of the owner thread. It is called by the owner thread.
+                bool pop(std::function<void()>& function) {
+                    QMutexLocker locker(&mutex);
+                    if (functions.empty()) {
+                        return false;
+                    }
+                    function = std::move(functions.back());
+                    functions.pop_back();
+                    return true;
+                }
+
+                /// Take the oldest function, which usually splits the largest part of the work. It is called by the other threads.
+                bool steal(std::function<void()>& function) {
+                    QMutexLocker locker(&mutex);
+                    if (functions.empty()) {
+                        return false;
+                    }
+                    function = std::move(functions.front());
+                    functions.pop_front();
+                    return true;
+                }
+
+            private:
+                QMutex mutex;
+                std::deque<std::function<void()>> functions;
+            };
+
+            class Thread : public QThread {
+            public:
+                Thread(WorkStealingScheduler* scheduler, int index) : scheduler(scheduler), index(index) {
+                }
+
+            protected:
+                void run() override {
+                    scheduler->work(index);
+                }
+
+            private:
+                WorkStealingScheduler* scheduler;
+                int index;
+            };
+
+            // The lock and the condition of the sleeping threads. They are shared with the callbacks waking up the threads waiting
+            // for a future, which may be called after the scheduler is destroyed.
+            class Sleep {
+            public:
+                QMutex mutex;
+                QWaitCondition wakeup;
+            };
+
+            WorkStealingScheduler(int threadCount) : deques(threadCount), sleep(QSharedPointer<Sleep>::create()) {
+                for (int i = 0 ; i < threadCount ; i++) {
+                    deques[i] = new Deque();
+                }
+
+                for (int i = 0 ; i < threadCount ; i++) {
+                    threads << new Thread(this, i);
+                    threads.last()->start();
+                }
+            }
+
+            ~WorkStealingScheduler() {
+                {
+                    QMutexLocker locker(&sleep->mutex);
+                    stopping.store(1);
+                    sleep->wakeup.wakeAll();
+                }
+
+                for (int i = 0 ; i < threads.size() ; i++) {
+                    threads[i]->wait();
+                    delete threads[i];
+                }
+                qDeleteAll(deques);
+            }
+
+            void start(const std::function<void()>& function) {
+                int index = currentIndex;
+                if (currentScheduler != this) {
+                    // Submitted by other threads. Spread them over the deques.
+                    index = (quint32) roundRobin.fetchAndAddRelaxed(1) % deques.size();
+                }
+
+                deques[index]->push(function);
+                pending.fetchAndAddOrdered(1);
+
+                if (sleeping.fetchAndAddOrdered(0) > 0) {
+                    QMutexLocker locker(&sleep->mutex);
+                    sleep->wakeup.wakeOne();
+                }
+            }
+
+            int threadCount() const {
+                return deques.size();
+            }
+
+            /// Run the functions of the deques until isFinished() returns true or it times out. It is called by a worker thread waiting
+            /// for a future. It sleeps while there is nothing to run, until a function is started or the callback of wake() is called.
+            void help(std::function<bool()> isFinished, int timeout) {
+                QElapsedTimer timer;
+                timer.start();
+
+                std::function<void()> function;
+                while (!isFinished()) {
+                    if (take(currentIndex, function)) {
+                        pending.fetchAndAddOrdered(-1);
+                        function();
+                        function = std::function<void()>();
+                        continue;
+                    }
+
+                    unsigned long remaining = ULONG_MAX;
+                    if (timeout >= 0) {
+                        qint64 elapsed = timer.elapsed();
+                        if (elapsed >= timeout) {
+                            break;
+                        }
+                        remaining = timeout - elapsed;
+                    }
+
+                    QMutexLocker locker(&sleep->mutex);
+                    sleeping.fetchAndAddOrdered(1);
+                    // isFinished() is checked under the lock, so a wake up after the future is finished is never missed
+                    if (pending.fetchAndAddOrdered(0) == 0 && !isFinished()) {
+                        sleep->wakeup.wait(&sleep->mutex, remaining);
+                    }
+                    sleeping.fetchAndAddOrdered(-1);
+                }
+            }
+
+            /// Returns a callback waking up the threads sleeping in help(). It could be called on any thread and even after the
+            /// scheduler is destroyed.
+            std::function<void()> wake() const {
+                QSharedPointer<Sleep> sleep = this->sleep;
+                return [sleep]() {
+                    QMutexLocker locker(&sleep->mutex);
+                    sleep->wakeup.wakeAll();
+                };
+            }
+
+        private:
+            bool take(int index, std::function<void()>& function) {
+                if (deques[index]->pop(function)) {
+                    return true;
+                }
+
+                for (int i = 1 ; i < deques.size() ; i++) {
+                    if (deques[(index + i) % deques.size()]->steal(function)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void work(int index) {
+                currentScheduler = this;
+                currentIndex = index;
+
+                std::function<void()> function;
+                while (true) {
+                    if (take(index, function)) {
+                        pending.fetchAndAddOrdered(-1);
+                        function();
+                        function = std::function<void()>();
+                        continue;
+                    }
+
+                    QMutexLocker locker(&sleep->mutex);
+                    sleeping.fetchAndAddOrdered(1);
+                    if (pending.fetchAndAddOrdered(0) == 0) {
+                        if (stopping.load()) {
+                            sleeping.fetchAndAddOrdered(-1);
+                            break;
+                        }
+                        sleep->wakeup.wait(&sleep->mutex);
+                    }
+                    sleeping.fetchAndAddOrdered(-1);
+                }
+            }
+
+            QVector<Deque*> deques;
+
+            QList<Thread*> threads;
+
+            /// no. of functions in the deques
+            QAtomicInt pending;
+
+            /// no. of threads waiting for functions
+            QAtomicInt sleeping;
+
+            QAtomicInt stopping;
+
+            QAtomicInt roundRobin;
+
+            QSharedPointer<Sleep> sleep;
+        };
+    }
+}
+
+bool Private::waitOnWorkerThread(std::function<bool ()> isFinished, std::function<void (std::function<void ()>)> subscribe,
+                                 std::function<void ()> block, int timeout) {
+    if (currentScheduler == nullptr && currentPool == nullptr) {
+        return false;
+    }
+
+    if (currentScheduler != nullptr) {
+        // Help the other workers, so that nested tasks started by this worker are not stuck in its own deque
+        WorkStealingScheduler* scheduler = (WorkStealingScheduler*) currentScheduler;
+        subscribe(scheduler->wake());
+        scheduler->help(isFinished, timeout);
+        return true;
+    }
+
+    // Let the pool start another thread while this one is blocked, so the parallelism stays at maxThreadCount()
+    QThreadPool* pool = currentPool;
+    pool->releaseThread();
+    if (timeout < 0) {
+        block();
+    } else if (!isFinished()) {
+        QSharedPointer<QSemaphore> semaphore = QSharedPointer<QSemaphore>::create();
+        subscribe([semaphore]() {
+            semaphore->release();
+        });
+        semaphore->tryAcquire(1, timeout);
+    }
+    pool->reserveThread();
+
+    return true;
+}
+
+WorkStealingExecutor::WorkStealingExecutor(int threadCount) :
+    scheduler(new Private::WorkStealingScheduler(threadCount > 0 ? threadCount : qMax(QThread::idealThreadCount(), 1))) {
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+    delete scheduler;
+}
+
+void WorkStealingExecutor::start(std::function<void ()> function, int priority) {
+    Q_UNUSED(priority);
+    scheduler->start(function);
+}
+
+int WorkStealingExecutor::maxThreadCount() const {
+    return scheduler->threadCount();
+}
+
+namespace AConcurrent {
+    namespace Private {
+
+        // FairShareScheduler holds the lanes of FairShareExecutor and feeds the underlying executor by deficit round-robin
+        class FairShareScheduler {
+        public:
+            class Task {
+            public:
+                std::function<void()> function;
+                int priority;
+            };
+
+            class Lane {
+            public:
+                Lane(int weight) : weight(weight), deficit(0), size(0), active(false) {
+                }
+
+                int weight;
+
+                /// The no. of functions the lane could still start in its current turn
+                int deficit;
+
+                /// Queued functions keyed by priority
+                QMap<int, QQueue<Task>> tasks;
+
+                int size;
+
+                /// True if it is in the round-robin list
+                bool active;
+            };
+
+            FairShareScheduler(ExecutorRef executor) : executor(executor), running(0), cursor(0) {
+            }
+
+            int maxThreadCount() const {
+                return executor->maxThreadCount();
+            }
+
+            static void start(QSharedPointer<FairShareScheduler> scheduler, QSharedPointer<Lane> lane, std::function<void()> function, int priority) {
+                {
+                    QMutexLocker locker(&scheduler->mutex);
+                    Task task;
+                    task.function = function;
+                    task.priority = priority;
+                    lane->tasks[priority].enqueue(task);
+                    lane->size++;
+                    if (!lane->active) {
+                        lane->active = true;
+                        scheduler->lanes << lane;
+                    }
+                }
+                dispatch(scheduler);
+            }
+
+        private:
+            /// Start queued functions until the underlying executor is full. It could be called by any thread.
+            static void dispatch(QSharedPointer<FairShareScheduler> scheduler) {
+                forever {
+                    Task task;
+                    {
+                        QMutexLocker locker(&scheduler->mutex);
+                        if (scheduler->running >= qMax(scheduler->executor->maxThreadCount(), 1) || !scheduler->take(task)) {
+                            return;
+                        }
+                        scheduler->running++;
+                    }
+
+                    std::function<void()> function = task.function;
+                    scheduler->executor->start([=]() {
+                        function();
+                        {
+                            QMutexLocker locker(&scheduler->mutex);
+                            scheduler->running--;
+                        }
+                        dispatch(scheduler);
+                    }, task.priority);
+                }
+            }
+
+            /// Take the next function from the lane at the cursor. A lane gains its weight on each turn and keeps the turn until it has
+            /// spent it or it becomes empty. It must be called with the mutex locked.
+            bool take(Task& task) {
+                if (lanes.isEmpty()) {
+                    return false;
+                }
+
+                if (cursor >= lanes.size()) {
+                    cursor = 0;
+                }
+
+                QSharedPointer<Lane> lane = lanes[cursor];
+                if (lane->deficit <= 0) {
+                    lane->deficit += lane->weight;
+                }
+
+                auto iter = lane->tasks.end();
+                iter--;
+                task = iter.value().dequeue();
+                if (iter.value().isEmpty()) {
+                    lane->tasks.erase(iter);
+                }
+                lane->size--;
+                lane->deficit--;
+
+                if (lane->size == 0) {
+                    // The next lane moves to the cursor
+                    lane->deficit = 0;
+                    lane->active = false;
+                    lanes.removeAt(cursor);
+                } else if (lane->deficit <= 0) {
+                    cursor++;
+                }
+
+                return true;
+            }
+
+            ExecutorRef executor;
+
+            QMutex mutex;
+
+            /// The no. of functions started on the underlying executor but not finished yet
+            int running;
+
+            /// The lanes with queued functions in round-robin order
+            QList<QSharedPointer<Lane>> lanes;
+
+            /// The lane taking its turn
+            int cursor;
+        };
+
+        class FairShareLane : public Executor {
+        public:
+            FairShareLane(QSharedPointer<FairShareScheduler> scheduler, int weight) :
+                scheduler(scheduler), lane(QSharedPointer<FairShareScheduler::Lane>::create(qMax(weight, 1))) {
+            }
+
+            void start(std::function<void()> function, int priority = 0) override {
+                FairShareScheduler::start(scheduler, lane, function, priority);
+            }
+
+            int maxThreadCount() const override {
+                return scheduler->maxThreadCount();
+            }
+
+        private:
+            QSharedPointer<FairShareScheduler> scheduler;
+            QSharedPointer<FairShareScheduler::Lane> lane;
+        };
+
+    }
+}
+
+FairShareExecutor::FairShareExecutor(ExecutorRef executor) : scheduler(QSharedPointer<Private::FairShareScheduler>::create(executor)) {
+    defaultLane = lane(1);
+}
+
+ExecutorRef FairShareExecutor::lane(int weight) {
+    return ExecutorRef(QSharedPointer<Executor>(new Private::FairShareLane(scheduler, weight)));
+}
+
+void FairShareExecutor::start(std::function<void ()> function, int priority) {
+    defaultLane->start(function, priority);
+}
+
+int FairShareExecutor::maxThreadCount() const {
+    return scheduler->maxThreadCount();
+}
@@ -6,6 +6,8 @@
 #include <QTimer>
 #include <asyncfuture.h>
 #include <functional>
+#include <algorithm>
+#include <deque>
 
 /* Enhance QtConcurrent by AsyncFuture
  *
@@ -16,14 +18,467 @@
 
 namespace AConcurrent {
 
+    /// Options to control how a Pipeline (and mapped()) dispatches its items to the thread pool
+    class PipelineOptions {
+    public:
+        enum {
+            /// Measure the duration of the early tasks and choose the grain size automatically
+            AdaptiveGrainSize = 0
+        };
+
+        enum DispatchMode {
+            /// Every finished task returns to the main thread to report its result and start the next task
+            MainThreadDispatch,
+
+            /// Workers claim the next items by an atomic counter and report the results by themselves.
+            /// The main thread is only notified to update the progress and finish the future.
+            /// It is supported by mapped() and blockingMapped() only.
+            WorkerDispatch
+        };
+
+        enum ResultOrder {
+            /// Results are reported at the index of their input item. The future may have gaps until the earlier items are finished.
+            OrderedResults,
+
+            /// Results are reported in the order of completion. Pipeline::sourceIndexAt() tells the index of their input item.
+            /// mapped() only returns the future, so use a Pipeline if the index is needed.
+            UnorderedResults,
+
+            /// Results are reported in input order. Each contiguous run of finished items is released as soon as it is complete.
+            /// Items are not dispatched more than reorderBufferSize() ahead of the first unreleased item.
+            StreamingOrderedResults
+        };
+
+        PipelineOptions() : m_grainSize(1), m_dispatchMode(MainThreadDispatch), m_resultOrder(OrderedResults), m_reorderBufferSize(0), m_capacity(0), m_maxConcurrency(0), m_rateLimit(0), m_rateBurst(1), m_hedgingPercentile(0), m_adaptiveConcurrency(false) {
+        }
+
+        /// The number of contiguous items executed by a single task. The default value is 1 (one task per item).
+        /// Set it to AdaptiveGrainSize to let the pipeline choose it from the measured cost of each item.
+        PipelineOptions& setGrainSize(int value) {
+            m_grainSize = qMax<int>(value, AdaptiveGrainSize);
+            return *this;
+        }
+
+        int grainSize() const {
+            return m_grainSize;
+        }
+
+        PipelineOptions& setDispatchMode(DispatchMode value) {
+            m_dispatchMode = value;
+            return *this;
+        }
+
+        DispatchMode dispatchMode() const {
+            return m_dispatchMode;
+        }
+
+        /// Set the order of results. WorkerDispatch publishes the finished prefix of the results for both OrderedResults and
+        /// StreamingOrderedResults, but it doesn't bound the items run ahead by reorderBufferSize().
+        PipelineOptions& setResultOrder(ResultOrder value) {
+            m_resultOrder = value;
+            return *this;
+        }
+
+        ResultOrder resultOrder() const {
+            return m_resultOrder;
+        }
+
+        /// The bound of the reorder buffer used by StreamingOrderedResults. The default value 0 means 4 items per thread of the pool.
+        PipelineOptions& setReorderBufferSize(int value) {
+            m_reorderBufferSize = value;
+            return *this;
+        }
+
+        int reorderBufferSize() const {
+            return m_reorderBufferSize;
+        }
+
+        /// The max. total cost of unfinished items of a Pipeline. The default value 0 means unbounded.
+        /// Every item costs 1 unless Pipeline::setCostFunction() is called. Producers should use Pipeline::tryAdd(),
+        /// Pipeline::blockingAdd() or Pipeline::spaceAvailable() to respect it. Pipeline::add() never refuses an item.
+        PipelineOptions& setCapacity(qint64 value) {
+            m_capacity = value;
+            return *this;
+        }
+
+        qint64 capacity() const {
+            return m_capacity;
+        }
+
+        /// The max. no. of tasks of a Pipeline running at the same time. The default value 0 means the max. thread count of the pool,
+        /// or 1024 outstanding futures for an asynchronous worker returning QFuture.
+        PipelineOptions& setMaxConcurrency(int value) {
+            m_maxConcurrency = qMax(value, 0);
+            return *this;
+        }
+
+        int maxConcurrency() const {
+            return m_maxConcurrency;
+        }
+
+        /// Dispatch at most itemsPerSecond items per second, with bursts of up to burst items. The default value 0 means unlimited.
+        /// Items over the limit wait on a timer instead of occupying the threads of the pool.
+        /// It requires MainThreadDispatch. See requiresMainThreadDispatch().
+        PipelineOptions& setRateLimit(qreal itemsPerSecond, int burst = 1) {
+            m_rateLimit = qMax<qreal>(itemsPerSecond, 0);
+            m_rateBurst = qMax(burst, 1);
+            return *this;
+        }
+
+        qreal rateLimit() const {
+            return m_rateLimit;
+        }
+
+        int rateBurst() const {
+            return m_rateBurst;
+        }
+
+        /// Run a duplicate of a task if it runs longer than the percentile (e.g. 0.95) of the recent task latencies and a thread is idle.
+        /// The first result is taken and the token of the other copy is canceled. The worker must be idempotent.
+        /// The default value 0 disables it. It requires MainThreadDispatch. See requiresMainThreadDispatch().
+        PipelineOptions& setHedgingPercentile(qreal value) {
+            m_hedgingPercentile = qBound<qreal>(0, value, 1);
+            return *this;
+        }
+
+        qreal hedgingPercentile() const {
+            return m_hedgingPercentile;
+        }
+
+        /// Tune the no. of running tasks between 1 and maxConcurrency() (or the max. thread count of the pool) by the observed latency.
+        /// It grows while the latency stays close to the lowest latency observed recently and backs off once the latency is doubled,
+        /// e.g. when the pool is shared with other pipelines or an I/O bound worker saturates its service.
+        /// It requires MainThreadDispatch. See requiresMainThreadDispatch().
+        PipelineOptions& setAdaptiveConcurrency(bool value) {
+            m_adaptiveConcurrency = value;
+            return *this;
+        }
+
+        bool adaptiveConcurrency() const {
+            return m_adaptiveConcurrency;
+        }
+
+        /// Returns true if an option is only supported by the dispatch on the main thread, so mapped() uses MainThreadDispatch
+        /// even if WorkerDispatch is set. New options of the kind must be checked here.
+        bool requiresMainThreadDispatch() const {
+            return m_rateLimit > 0 || m_hedgingPercentile > 0 || m_adaptiveConcurrency;
+        }
+
+    private:
+        int m_grainSize;
+        DispatchMode m_dispatchMode;
+        ResultOrder m_resultOrder;
+        int m_reorderBufferSize;
+        qint64 m_capacity;
+        int m_maxConcurrency;
+        qreal m_rateLimit;
+        int m_rateBurst;
+        qreal m_hedgingPercentile;
+        bool m_adaptiveConcurrency;
+    };
+
+    /// Metrics is a snapshot of the runtime metrics of a Pipeline or a Queue. Times are in nsec.
+    /// Metrics are not collected if ACONCURRENT_NO_METRICS is defined.
+    class Metrics {
+    public:
+        enum {
+            /// Bucket i of executionTimeHistogram counts the items taking less than 2^i usec. The last bucket counts the rest.
+            HistogramSize = 24
+        };
+
+        Metrics() : queued(0), running(0), completed(0), totalWaitTime(0), totalDispatchLatency(0), finishedTasks(0), elapsed(0),
+            hedged(0), hedgeWins(0), executionTimeHistogram(HistogramSize, 0) {
+        }
+
+        /// No. of items waiting to be dispatched
+        qint64 queued;
+
+        /// No. of items dispatched but not finished
+        qint64 running;
+
+        /// No. of finished items
+        qint64 completed;
+
+        /// The total time of items between being added and being dispatched
+        qint64 totalWaitTime;
+
+        /// The total time between a task being finished by a worker and being handled on the main thread
+        qint64 totalDispatchLatency;
+
+        /// No. of finished tasks. A task runs one or more items.
+        qint64 finishedTasks;
+
+        /// The time since the Pipeline or the Queue is created
+        qint64 elapsed;
+
+        /// No. of duplicated tasks started by PipelineOptions::setHedgingPercentile()
+        qint64 hedged;
+
+        /// No. of duplicated tasks finished before the original ones
+        qint64 hedgeWins;
+
+        QVector<qint64> executionTimeHistogram;
+
+        qint64 averageWaitTime() const {
+            qint64 dispatched = running + completed;
+            return dispatched > 0 ? totalWaitTime / dispatched : 0;
+        }
+
+        qint64 averageDispatchLatency() const {
+            return finishedTasks > 0 ? totalDispatchLatency / finishedTasks : 0;
+        }
+
+        /// Finished items per second
+        qreal throughput() const {
+            return elapsed > 0 ? completed * 1000000000.0 / elapsed : 0;
+        }
+    };
+
+    /// CancellationToken tells a running worker that its Pipeline or mapped() is canceled. A worker taking it as the second argument
+    /// (e.g. [](const Image& image, const AConcurrent::CancellationToken& token)) may poll isCanceled() and return early.
+    class CancellationToken {
+    public:
+        /// A token which is never canceled
+        CancellationToken() : count(0) {
+        }
+
+        /// A token which is canceled once the future is canceled
+        explicit CancellationToken(QFuture<void> future) : future(future), count(1) {
+        }
+
+        /// It reads the state of the future by an atomic load, so it is cheap to be polled.
+        bool isCanceled() const {
+            return (count > 0 && future.isCanceled()) || (count > 1 && other.isCanceled());
+        }
+
+        /// Returns a token which is also canceled once the other future is canceled. A token could be linked once.
+        CancellationToken linked(QFuture<void> otherFuture) const {
+            CancellationToken res = *this;
+            if (count == 0) {
+                res.future = otherFuture;
+                res.count = 1;
+            } else {
+                res.other = otherFuture;
+                res.count = 2;
+            }
+            return res;
+        }
+
+    private:
+        QFuture<void> future;
+        QFuture<void> other;
+
+        /// no. of valid futures
+        int count;
+    };
+
+    /// Executor runs functions on worker threads. Pipeline, Queue, mapped() and the other functions take an Executor or a QThreadPool.
+    class Executor {
+    public:
+        virtual ~Executor() {
+        }
+
+        /// Run the function on a worker thread. Functions with higher priority are started first if the executor supports it.
+        /// It could be called by any thread.
+        virtual void start(std::function<void()> function, int priority = 0) = 0;
+
+        /// The no. of worker threads
+        virtual int maxThreadCount() const = 0;
+    };
+
+    /// ThreadPoolExecutor runs functions on a QThreadPool. It is the default executor.
+    class ThreadPoolExecutor : public Executor {
+    public:
+        ThreadPoolExecutor(QThreadPool* pool = QThreadPool::globalInstance()) : pool(pool) {
+        }
+
+        void start(std::function<void()> function, int priority = 0) override;
+
+        int maxThreadCount() const override;
+
+    private:
+        QPointer<QThreadPool> pool;
+    };
+
+    namespace Private {
+        class WorkStealingScheduler;
+    }
+
+    /// WorkStealingExecutor runs functions on its own threads. Each thread has a deque of functions and takes the functions of the
+    /// other threads once its own deque is empty. Functions started by a worker thread are pushed to its own deque, so that
+    /// fine-grained tasks don't contend on a single queue. The priority is ignored.
+    class WorkStealingExecutor : public Executor {
+    public:
+        /// Start threadCount threads. The default value 0 means QThread::idealThreadCount().
+        WorkStealingExecutor(int threadCount = 0);
+
+        /// Wait for all the started functions and stop the threads
+        ~WorkStealingExecutor();
+
+        void start(std::function<void()> function, int priority = 0) override;
+
+        int maxThreadCount() const override;
+
+    private:
+        Q_DISABLE_COPY(WorkStealingExecutor)
+
+        Private::WorkStealingScheduler* scheduler;
+    };
+
+    /// ExecutorRef refers to an Executor or a QThreadPool. The caller keeps the ownership of an Executor.
+    class ExecutorRef {
+    public:
+        ExecutorRef(QThreadPool* pool = QThreadPool::globalInstance()) : poolExecutor(pool), executor(nullptr) {
+        }
+
+        ExecutorRef(Executor* executor) : executor(executor) {
+        }
+
+        /// Share the ownership of the executor
+        ExecutorRef(QSharedPointer<Executor> executor) : executor(executor.data()), owner(executor) {
+        }
+
+        Executor* operator->() const {
+            return executor ? executor : &poolExecutor;
+        }
+
+    private:
+        // A QThreadPool is wrapped in place, so converting it to an ExecutorRef doesn't allocate
+        mutable ThreadPoolExecutor poolExecutor;
+
+        Executor* executor;
+
+        QSharedPointer<Executor> owner;
+    };
+
+    namespace Private {
+        class FairShareScheduler;
+    }
+
+    /// FairShareExecutor shares an executor (e.g. a QThreadPool) between pipelines fairly. Each pipeline runs on its own lane with a weight.
+    /// It holds at most maxThreadCount() functions in the underlying executor and starts the functions queued in the lanes by
+    /// deficit round-robin, so a lane with weight 3 gets 3 times the threads of a lane with weight 1 while both are busy, and a lane
+    /// is never starved by another lane which has queued a lot of functions. Within a lane, functions with higher priority are started first.
+    ///
+    /// Functions must not block on the other functions of the same FairShareExecutor, as they may not be started until a thread is free.
+    class FairShareExecutor : public Executor {
+    public:
+        FairShareExecutor(ExecutorRef executor = ExecutorRef());
+
+        /// Create a lane with the weight. The lane could be passed to pipeline(), mapped(), queue() etc in place of an executor.
+        /// It keeps this executor's scheduler alive, and queued functions are still run after the lane is released.
+        ExecutorRef lane(int weight = 1);
+
+        /// Run the function on the default lane, which has weight 1
+        void start(std::function<void()> function, int priority = 0) override;
+
+        int maxThreadCount() const override;
+
+    private:
+        Q_DISABLE_COPY(FairShareExecutor)
+
+        QSharedPointer<Private::FairShareScheduler> scheduler;
+        ExecutorRef defaultLane;
+    };
+
     namespace Private {
 
+        // MpscQueue is a lock-free multiple-producer single-consumer queue.
+        template <typename T>
+        class MpscQueue {
+        public:
+            MpscQueue() {
+            }
+
+            ~MpscQueue() {
+                consume([](const T&) {});
+            }
+
+            /// Push a value from any thread. It returns true if the queue was empty before.
+            bool push(const T& value) {
+                Node* node = new Node(value);
+                Node* head;
+                do {
+                    head = top.loadAcquire();
+                    node->next = head;
+                } while (!top.testAndSetRelease(head, node));
+                return head == nullptr;
+            }
+
+            /// Take all the queued values in FIFO order. Only one consumer could call it at a time.
+            template <typename Functor>
+            int consume(Functor functor) {
+                Node* head = top.fetchAndStoreAcquire(nullptr);
+
+                // The values are stacked in LIFO order. Reverse it.
+                Node* prev = nullptr;
+                while (head) {
+                    Node* next = head->next;
+                    head->next = prev;
+                    prev = head;
+                    head = next;
+                }
+
+                int count = 0;
+                while (prev) {
+                    Node* next = prev->next;
+                    functor(prev->value);
+                    delete prev;
+                    prev = next;
+                    count++;
+                }
+                return count;
+            }
+
+        private:
+            class Node {
+            public:
+                Node(const T& value) : value(value), next(nullptr) {
+                }
+
+                T value;
+                Node* next;
+            };
+
+            QAtomicPointer<Node> top;
+        };
+
+        // Dispatcher executes functions on the main thread. Functions posted from any thread are queued in a lock-free queue,
+        // and the main thread drains all of them on a single event. The drained functions are kept in a member list, so that
+        // a function nesting an event loop (e.g. await()) doesn't hold back the functions queued after it.
+        class Dispatcher : public QObject {
+        public:
+            static Dispatcher* instance();
+
+            void post(std::function<void()> func);
+
+        protected:
+            bool event(QEvent* event) override;
+
+        private:
+            Dispatcher();
+
+            MpscQueue<std::function<void()>> queue;
+
+            /// Functions taken from the queue but not run yet. It is only accessed by the main thread.
+            std::deque<std::function<void()>> drained;
+
+            /// True if an event is posted to run the rest of drained
+            bool redispatching;
+        };
+
         template <typename Functor>
         inline void runOnMainThreadVoid(Functor func)  {
-            QObject tmp;
-            QObject::connect(&tmp, &QObject::destroyed, QCoreApplication::instance(), func, Qt::QueuedConnection);
+            Dispatcher::instance()->post(func);
         }
 
+        /// Wait on a worker thread started by an Executor. WorkStealingExecutor runs the queued functions while waiting, and
+        /// ThreadPoolExecutor lets the pool start another thread. subscribe(callback) must call the callback once the awaited
+        /// future is finished, so the thread sleeps instead of polling. block() waits without a timeout.
+        /// Returns false without waiting if the current thread is not a worker thread.
+        bool waitOnWorkerThread(std::function<bool()> isFinished, std::function<void(std::function<void()>)> subscribe,
+                                std::function<void()> block, int timeout);
+
         // Value is a wrapper of data structure which could contain <void> type.
         template <typename R>
         class Value {
@@ -105,9 +560,59 @@ namespace AConcurrent {
             };
         };
 
+        /// The worker of Pipeline and mapped(). It takes the CancellationToken of the pipeline.
+        template <typename RET, typename ARG>
+        using Worker = std::function<RET(const ARG&, const CancellationToken&)>;
+
+        /// worker_result<Functor>::type is the result of a worker. A worker returning QFuture<R> is asynchronous and its result is R.
+        template <typename Functor, typename T = typename function_traits<Functor>::result_type>
+        struct worker_result {
+            typedef T type;
+            static const bool async = false;
+        };
+
+        template <typename Functor, typename R>
+        struct worker_result<Functor, QFuture<R>> {
+            typedef R type;
+            static const bool async = true;
+        };
+
+        /// The default max. no. of running tasks of an asynchronous worker, as they don't hold any thread
+        const int AsyncConcurrency = 1024;
+
+        // WorkerAdapter turns a functor taking (ARG) or (ARG, CancellationToken) into a Worker
+        template <typename RET, typename ARG, typename Functor, int Arity = function_traits<Functor>::arity>
+        class WorkerAdapter {
+        public:
+            static Worker<RET, ARG> adapt(Functor func) {
+                return [=](const ARG& value, const CancellationToken& token) mutable {
+                    Q_UNUSED(token);
+                    return func(value);
+                };
+            }
+        };
+
+        template <typename RET, typename ARG, typename Functor>
+        class WorkerAdapter<RET, ARG, Functor, 2> {
+        public:
+            static Worker<RET, ARG> adapt(Functor func) {
+                static_assert(std::is_convertible<const CancellationToken&, typename function_traits<Functor>::template arg<1>::type>::value,
+                              "The second argument of a worker must be AConcurrent::CancellationToken");
+                return [=](const ARG& value, const CancellationToken& token) mutable {
+                    return func(value, token);
+                };
+            }
+        };
+
+        template <typename RET, typename ARG, typename Functor>
+        inline Worker<RET, ARG> adaptWorker(Functor func) {
+            return WorkerAdapter<RET, ARG, Functor>::adapt(func);
+        }
+
         template <typename R>
         inline void completeDefer(AsyncFuture::Deferred<R> defer, const QVector<QFuture<R>> &futures) {
             QList<R> res;
+            res.reserve(futures.size());
             for (int i = 0 ; i < futures.size() ;i++) {
                 res << futures[i].result();
             }
@@ -120,225 +625,2318 @@ namespace AConcurrent {
             defer.complete();
         }
 
-        inline QString key(QObject* object, QString extraKey) {
-            return QString("%1-%2").arg(QString::number((long) object, 16) ).arg(extraKey);
-        }
-
-        extern QMap<QString, QFuture<void>> debounceStore;
-
-        template <typename T>
-        class CustomDeferred : public AsyncFuture::Deferred<T> {
+        // DebounceKey identifies a debounce() call by its context object and key. The hash is computed once.
+        class DebounceKey {
         public:
-            void setProgressValue(int value) {
-                AsyncFuture::Deferred<T>::deferredFuture->setProgressValue(value);
-            }
-
-            void setProgressRange(int min, int max) {
-                AsyncFuture::Deferred<T>::deferredFuture->setProgressRange(min, max);
-            }
-
-            void reportResult(T value, int index) {
-                AsyncFuture::Deferred<T>::deferredFuture->reportResult(value, index);
+            DebounceKey() : object(nullptr), hash(0) {
             }
 
-            void finish() {
-                AsyncFuture::Deferred<T>::deferredFuture->complete();
+            DebounceKey(QObject* object, const QString& extraKey) : object(object), extraKey(extraKey) {
+                hash = qHash(object) ^ (qHash(extraKey) + 0x9e3779b9 + (qHash(object) << 6));
             }
-        };
 
-        template <>
-        class CustomDeferred<void> : public AsyncFuture::Deferred<void> {
-        public:
-            void setProgressValue(int value) {
-                AsyncFuture::Deferred<void>::deferredFuture->setProgressValue(value);
+            bool operator==(const DebounceKey& other) const {
+                return hash == other.hash && object == other.object && extraKey == other.extraKey;
             }
 
-            void setProgressRange(int min, int max) {
-                AsyncFuture::Deferred<void>::deferredFuture->setProgressRange(min, max);
+            bool operator!=(const DebounceKey& other) const {
+                return !(*this == other);
             }
 
-            void finish() {
-                AsyncFuture::Deferred<void>::deferredFuture->complete();
-            }
+            QObject* object;
+            QString extraKey;
+            uint hash;
         };
 
-        template <typename T>
-        inline void pipelineReportResult(CustomDeferred<T>& defer, int index, QFuture<T> future) {
-            auto value = future.result();
-            defer.reportResult(value, index);
+        inline uint qHash(const DebounceKey& key, uint seed = 0) {
+            return key.hash ^ seed;
         }
 
-        template <>
-        inline void pipelineReportResult<void>(CustomDeferred<void>& defer, int index, QFuture<void> future) {
-            Q_UNUSED(defer);
-            Q_UNUSED(index);
-            Q_UNUSED(future);
+        inline DebounceKey key(QObject* object, QString extraKey) {
+            return DebounceKey(object, extraKey);
         }
 
-        template <typename RET, typename ARG>
-        class PipelineContext {
-        private:
-            /// Variables access is not allowed out of the main thread except the initialization
+        // DebounceStore maps a DebounceKey to the pending future of debounce(). The keys are spread over
+        // shards with their own lock, so it could be used from any thread. The entries of a context object
+        // are canceled and removed once it is destroyed.
+        class DebounceStore {
+        public:
+            DebounceStore();
 
-            QPointer<QThreadPool> pool;
-            std::function<RET(ARG)> worker;
-            int next;
-            QList<ARG> input;
+            /// Set the future of a key and return the previous one (or an empty future).
+            QFuture<void> replace(const DebounceKey& key, QFuture<void> future);
 
-            /// no. of running tasks
-            int running;
+            /// Returns true if the future is the latest one of the key.
+            bool isCurrent(const DebounceKey& key, const QFuture<void>& future) const;
 
-            int completedCount;
+            /// Remove the key if the future is the latest one.
+            void remove(const DebounceKey& key, const QFuture<void>& future);
 
-            Private::CustomDeferred<RET> defer;
+            /// Cancel and remove all the entries of a context object
+            void purge(QObject* object);
 
-            QList<AsyncFuture::Deferred<RET>> tasks;
+            int size() const;
 
-            bool closed;
+        private:
+            Q_DISABLE_COPY(DebounceStore)
 
-            bool autoDelete;
+            enum {
+                ShardCount = 16
+            };
 
-            void checkDelete() {
-                if (autoDelete) {
-                    runOnMainThreadVoid([=]() {
-                       delete this;
-                    });
-                }
+            struct Shard {
+                mutable QMutex mutex;
+                QHash<DebounceKey, QFuture<void>> futures;
+
+                // Context objects with a key in this shard. Each of them is connected once per shard, so checking it only takes the shard lock.
+                QSet<QObject*> watched;
+            };
+
+            Shard& shardOf(const DebounceKey& key) {
+                return shards[key.hash % ShardCount];
             }
 
-            void run() {
-                if (running >= pool->maxThreadCount() || next >= input.size()) {
-                    return;
-                }
+            const Shard& shardOf(const DebounceKey& key) const {
+                return shards[key.hash % ShardCount];
+            }
 
-                int index = next;
-                ARG inputValue = input.at(next);
-                auto task = tasks.at(next);
-                next++;
-                running++;
+            /// Cancel and remove the entries of a context object in a shard. Returns the futures to be canceled outside of the lock.
+            QList<QFuture<void>> purge(Shard& shard, QObject* object);
 
-                auto future = QtConcurrent::run(pool, worker, inputValue);
-                task.complete(future);
-                task.subscribe([=]() {
-                    int progressValue = defer.future().progressValue();
-                    Private::pipelineReportResult<RET>(defer, index, task.future());
+            Shard shards[ShardCount];
+        };
 
-                    defer.setProgressValue(progressValue+1);
-                    completedCount++;
-                    running--;
+        extern DebounceStore debounceStore;
 
-                    if (closed && completedCount == tasks.size()) {
-                        defer.finish();
-                        checkDelete();
-                        return;
-                    }
+        // TimerWheel drives timeout(), withTimeout() and the time based debounce() and throttle() by a single timer.
+        // Timers are hashed into a hierarchical wheel of 4 levels x 64 slots (1ms per tick), so starting and
+        // canceling a timer are O(1). It could be used from any thread. Callbacks are executed on the main thread.
+        class TimerWheel : public QObject {
+        public:
+            static TimerWheel* instance();
 
-                    if (defer.future().isFinished() || defer.future().isCanceled()) {
+            /// Run callback after msec. Returns an id for cancel().
+            qint64 start(int msec, std::function<void()> callback);
+
+            /// Returns false if the timer is fired or canceled already.
+            bool cancel(qint64 id);
+
+            /// Run callback once debounce() is not called again with the same key for msec.
+            void debounce(const DebounceKey& key, int msec, std::function<void()> callback);
+
+            /// Run callback immediately unless the key has run within msec. The last call dropped during the period runs at the end of it.
+            void throttle(const DebounceKey& key, int msec, std::function<void()> callback);
+
+            /// No. of pending timers
+            int size() const;
+
+        protected:
+            void timerEvent(QTimerEvent* event) override;
+
+        private:
+            enum {
+                LevelCount = 4,
+                SlotBits = 6,
+                SlotCount = 1 << SlotBits,
+                SlotMask = SlotCount - 1
+            };
+
+            struct Timer {
+                qint64 id;
+                qint64 deadline;
+            };
+
+            // The state of a key of debounce() / throttle()
+            struct KeyedTimer {
+                KeyedTimer() : id(0) {
+                }
+
+                qint64 id;
+                std::function<void()> trailing;
+            };
+
+            TimerWheel();
+
+            qint64 now() const;
+
+            bool startLocked(qint64 id, int msec, std::function<void()> callback);
+
+            void insert(const Timer& timer);
+
+            void cascade(int level);
+
+            void advance(qint64 target, QList<std::function<void()>>& expired);
+
+            qint64 nextWake() const;
+
+            void schedule();
+
+            void requestSchedule();
+
+            std::function<void()> throttleWindow(const DebounceKey& key, qint64 id, int msec);
+
+            void watch(QObject* object);
+
+            void purge(QObject* object);
+
+            mutable QMutex mutex;
+            QElapsedTimer clock;
+            qint64 current;
+            qint64 nextId;
+            QVector<Timer> wheel[LevelCount][SlotCount];
+            QHash<qint64, std::function<void()>> callbacks;
+            QHash<DebounceKey, KeyedTimer> keyed;
+            QSet<QObject*> watched;
+
+            // The tick of the running QTimer, -1 if it is stopped. Only written by schedule().
+            qint64 wakeTick;
+            bool scheduling;
+            int timerId;
+        };
+
+        template <typename T>
+        class CustomDeferred : public AsyncFuture::Deferred<T> {
+        public:
+            void setProgressValue(int value) {
+                AsyncFuture::Deferred<T>::deferredFuture->setProgressValue(value);
+            }
+
+            void setProgressRange(int min, int max) {
+                AsyncFuture::Deferred<T>::deferredFuture->setProgressRange(min, max);
+            }
+
+            void reportResult(T value, int index) {
+                AsyncFuture::Deferred<T>::deferredFuture->reportResult(value, index);
+            }
+
+            void reportResults(const QVector<T>& values, int beginIndex = -1) {
+                AsyncFuture::Deferred<T>::deferredFuture->reportResults(values, beginIndex);
+            }
+
+            void finish() {
+                AsyncFuture::Deferred<T>::deferredFuture->complete();
+            }
+        };
+
+        template <>
+        class CustomDeferred<void> : public AsyncFuture::Deferred<void> {
+        public:
+            void setProgressValue(int value) {
+                AsyncFuture::Deferred<void>::deferredFuture->setProgressValue(value);
+            }
+
+            void setProgressRange(int min, int max) {
+                AsyncFuture::Deferred<void>::deferredFuture->setProgressRange(min, max);
+            }
+
+            void finish() {
+                AsyncFuture::Deferred<void>::deferredFuture->complete();
+            }
+        };
+
+        // GrainSize decides how many contiguous items should be executed by a single task.
+        class GrainSize {
+        public:
+            enum {
+                // The expected duration of a task in nsec
+                TargetDuration = 1000000
+            };
+
+            GrainSize(int fixed = 1) : fixed(fixed), cost(0) {
+            }
+
+            /// The no. of items to be taken by the next task
+            int next(int remaining, int workers) const {
+                if (fixed > 0) {
+                    return qMin(fixed, remaining);
+                }
+
+                if (cost <= 0) {
+                    // Nothing is measured yet. Run a single item.
+                    return qMin(1, remaining);
+                }
+
+                qint64 size = TargetDuration / cost;
+                // Leave at least 4 tasks per worker for the rest of items, so that the workload is still balanced at the end.
+                size = qMin<qint64>(size, remaining / (qMax(workers, 1) * 4));
+                return (int) qBound<qint64>(1, size, remaining);
+            }
+
+            /// Feed the measured duration (in nsec) of a task with no. of items
+            void update(int count, qint64 elapsed) {
+                if (fixed > 0 || count <= 0) {
+                    return;
+                }
+                qint64 itemCost = qMax<qint64>(elapsed / count, 1);
+                cost = cost == 0 ? itemCost : (cost * 3 + itemCost) / 4;
+            }
+
+        private:
+            int fixed;
+
+            // Average cost per item in nsec. 0 if it is not measured yet.
+            qint64 cost;
+        };
+
+        // MetricsCollector collects the Metrics of a Pipeline or a Queue. Counters are striped per thread and summed up by snapshot(),
+        // so recording is a relaxed atomic add on a counter rarely shared with other threads. It could be used from any thread.
+        class MetricsCollector {
+        public:
+#ifdef ACONCURRENT_NO_METRICS
+            enum { Enabled = false };
+#else
+            enum { Enabled = true };
+#endif
+
+            MetricsCollector();
+
+            /// The time in nsec since it is created
+            qint64 now() const {
+                return clock.nsecsElapsed();
+            }
+
+            void enqueued(int count);
+
+            /// Items are dispatched after waiting for waitTime in total
+            void dispatched(int count, qint64 waitTime);
+
+            /// Items are executed by a worker in elapsed nsec
+            void executed(int count, qint64 elapsed);
+
+            /// A task is handled on the main thread latency nsec after it is finished by a worker
+            void finished(int count, qint64 latency);
+
+            /// A duplicated task is started
+            void hedged();
+
+            /// A duplicated task is finished before the original one
+            void hedgeWon();
+
+            Metrics snapshot() const;
+
+        private:
+            Q_DISABLE_COPY(MetricsCollector)
+
+            enum {
+                StripeCount = 16
+            };
+
+            // A stripe ends with a full cache line of padding, so that threads updating adjacent stripes don't false-share. The collector
+            // is allocated by QSharedPointer::create(), which doesn't honour alignas, so the padding doesn't rely on the alignment.
+            struct Stripe {
+                QAtomicInteger<qint64> enqueued;
+                QAtomicInteger<qint64> dispatched;
+                QAtomicInteger<qint64> waitTime;
+                QAtomicInteger<qint64> completed;
+                QAtomicInteger<qint64> tasks;
+                QAtomicInteger<qint64> latency;
+                QAtomicInteger<qint64> hedged;
+                QAtomicInteger<qint64> hedgeWins;
+                QAtomicInteger<qint64> histogram[Metrics::HistogramSize];
+                char padding[64];
+            };
+
+            Stripe& local();
+
+            Stripe stripes[StripeCount];
+
+            QElapsedTimer clock;
+        };
+
+        // TokenBucket limits the rate of dispatched items. It refills rate tokens per second up to burst tokens.
+        class TokenBucket {
+        public:
+            TokenBucket(qreal rate = 0, int burst = 1) : rate(rate), burst(qMax(burst, 1)), tokens(qMax(burst, 1)), last(0) {
+                clock.start();
+            }
+
+            bool isLimited() const {
+                return rate > 0;
+            }
+
+            /// No. of items out of count which could be dispatched now
+            int available(int count) {
+                refill();
+                return qMin(count, (int) tokens);
+            }
+
+            void consume(int count) {
+                tokens -= count;
+            }
+
+            /// The time in msec until the next item could be dispatched
+            int waitTime() {
+                refill();
+                return qMax(1, (int) qCeil((1 - tokens) * 1000 / rate));
+            }
+
+        private:
+            void refill() {
+                qint64 now = clock.nsecsElapsed();
+                tokens = qMin<qreal>(burst, tokens + (now - last) * rate / 1000000000.0);
+                last = now;
+            }
+
+            qreal rate;
+            int burst;
+            qreal tokens;
+            qint64 last;
+            QElapsedTimer clock;
+        };
+
+        // AdaptiveLimit tunes the no. of running tasks by AIMD on the latency per item. It starts from 1 and doubles every round of tasks
+        // until the latency exceeds twice of the lowest latency observed recently. Then it grows by 1 per round and it is cut by a quarter
+        // (at most once per round) whenever the latency is doubled again. It only grows while the limit is reached, as a latency measured
+        // below the limit tells nothing about a higher one.
+        class AdaptiveLimit {
+        public:
+            AdaptiveLimit(bool enabled = false) : enabled(enabled), limit(1), minLatency(0), slowStart(true), sinceDecrease(0) {
+            }
+
+            bool isEnabled() const {
+                return enabled;
+            }
+
+            int value(int upper) const {
+                return qBound(1, (int) limit, qMax(upper, 1));
+            }
+
+            /// Update by the latency of a finished task. running is the no. of tasks running at the time, including the finished one.
+            void update(qint64 latency, int running, int upper) {
+                if (minLatency <= 0 || latency < minLatency) {
+                    minLatency = qMax<qint64>(latency, 1);
+                } else {
+                    // Drift upward slowly, so that the baseline follows a change of the workload
+                    minLatency += (latency - minLatency) / 256;
+                }
+
+                sinceDecrease++;
+                if (latency > minLatency * 2) {
+                    slowStart = false;
+                    if (sinceDecrease >= limit) {
+                        limit = qMax<qreal>(1, limit * 0.75);
+                        sinceDecrease = 0;
+                    }
+                } else if (running < value(upper)) {
+                    // Not saturated
+                } else if (slowStart) {
+                    limit = qMin<qreal>(upper, limit + 1);
+                } else {
+                    limit = qMin<qreal>(upper, limit + 1 / limit);
+                }
+            }
+
+        private:
+            bool enabled;
+            qreal limit;
+            qint64 minLatency;
+            bool slowStart;
+            int sinceDecrease;
+        };
+
+        // LatencyPercentile estimates a percentile of the recent task latencies from a ring of samples
+        class LatencyPercentile {
+        public:
+            enum {
+                SampleCount = 128,
+                MinSampleCount = 16
+            };
+
+            LatencyPercentile(qreal percentile = 0) : percentile(percentile), next(0), threshold(-1), dirty(false) {
+            }
+
+            bool isEnabled() const {
+                return percentile > 0;
+            }
+
+            void add(qint64 latency) {
+                if (samples.size() < SampleCount) {
+                    samples << latency;
+                } else {
+                    samples[next] = latency;
+                }
+                next = (next + 1) % SampleCount;
+                dirty = true;
+            }
+
+            /// Returns -1 if there are not enough samples
+            qint64 value() {
+                if (samples.size() < MinSampleCount) {
+                    return -1;
+                }
+
+                if (dirty) {
+                    QVector<qint64> sorted = samples;
+                    int k = qBound(0, (int) (percentile * sorted.size()), sorted.size() - 1);
+                    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+                    threshold = sorted[k];
+                    dirty = false;
+                }
+                return threshold;
+            }
+
+        private:
+            qreal percentile;
+            QVector<qint64> samples;
+            int next;
+            qint64 threshold;
+            bool dirty;
+        };
+
+        // ResultBuffer is a preallocated contiguous storage of results. Workers write to disjoint indexes without locking.
+        template <typename R>
+        class ResultBuffer {
+        public:
+            ResultBuffer() : storage(nullptr) {
+            }
+
+            void resize(int size) {
+                values.resize(size);
+                storage = values.data();
+            }
+
+            /// Run the items in [begin, end) of the input and write the results at the same indexes
+            template <typename Functor, typename Input>
+            void run(Functor functor, const Input& input, int begin, int end) {
+                for (int i = begin ; i < end ; i++) {
+                    storage[i] = functor(input.at(i));
+                }
+            }
+
+            /// Report the results in [begin, end) by a single batch and release them. Workers may still write the results after end.
+            void publish(CustomDeferred<R>& defer, int begin, int end) {
+                if (end <= begin) {
+                    return;
+                }
+                defer.reportResults(values.mid(begin, end - begin), begin);
+                for (int i = begin ; i < end ; i++) {
+                    storage[i] = R();
+                }
+            }
+
+        private:
+            QVector<R> values;
+            R* storage;
+        };
+
+        template <>
+        class ResultBuffer<void> {
+        public:
+            void resize(int size) {
+                Q_UNUSED(size);
+            }
+
+            template <typename Functor, typename Input>
+            void run(Functor functor, const Input& input, int begin, int end) {
+                for (int i = begin ; i < end ; i++) {
+                    functor(input.at(i));
+                }
+            }
+
+            void publish(CustomDeferred<void>& defer, int begin, int end) {
+                Q_UNUSED(defer);
+                Q_UNUSED(begin);
+                Q_UNUSED(end);
+            }
+        };
+
+        // PendingQueue holds the indexes of items not dispatched yet in buckets of priority. Each bucket is a list of contiguous ranges in input order.
+        // A waiting range gains 1 level of priority for every AgingInterval tasks taken after it is queued, so that low priority items are not starved.
+        class PendingQueue {
+        public:
+            enum {
+                AgingInterval = 16
+            };
+
+            PendingQueue() : count(0), tick(0) {
+            }
+
+            void enqueue(int index, int size, int priority) {
+                if (size <= 0) {
+                    return;
+                }
+
+                QList<Range>& bucket = buckets[priority];
+                // Items queued after a take are kept in a separate range, so that they don't inherit the age of the earlier items
+                if (!bucket.isEmpty() && bucket.last().end == index && bucket.last().tick == tick) {
+                    bucket.last().end += size;
+                } else {
+                    Range range;
+                    range.begin = index;
+                    range.end = index + size;
+                    range.tick = tick;
+                    bucket << range;
+                }
+                count += size;
+            }
+
+            /// Take at most max contiguous items of the highest effective priority. Only the items before limit could be taken.
+            /// priority is set to the priority the items were queued with, and effectivePriority to the aged one.
+            /// Returns false if there is no such item.
+            bool take(int max, int limit, int* index, int* size, int* priority, int* effectivePriority) {
+                auto best = buckets.end();
+                int bestScore = 0;
+
+                for (auto iter = buckets.begin() ; iter != buckets.end() ; iter++) {
+                    const Range& range = iter.value().first();
+                    if (range.begin >= limit) {
+                        continue;
+                    }
+
+                    int score = iter.key() + (tick - range.tick) / AgingInterval;
+                    if (best == buckets.end() || score > bestScore ||
+                        (score == bestScore && range.begin < best.value().first().begin)) {
+                        best = iter;
+                        bestScore = score;
+                    }
+                }
+
+                if (best == buckets.end()) {
+                    return false;
+                }
+
+                Range& range = best.value().first();
+                *index = range.begin;
+                *size = qMin(qMin(max, range.end - range.begin), limit - range.begin);
+                *priority = best.key();
+                *effectivePriority = bestScore;
+
+                range.begin += *size;
+                if (range.begin >= range.end) {
+                    best.value().removeFirst();
+                    if (best.value().isEmpty()) {
+                        buckets.erase(best);
+                    }
+                }
+                count -= *size;
+                tick++;
+                return true;
+            }
+
+            /// The pending ranges [begin, end) of all the buckets sorted by begin
+            QVector<QPair<int, int>> ranges() const {
+                QVector<QPair<int, int>> result;
+                for (auto iter = buckets.begin() ; iter != buckets.end() ; iter++) {
+                    const QList<Range>& bucket = iter.value();
+                    for (int i = 0 ; i < bucket.size() ; i++) {
+                        result << qMakePair(bucket[i].begin, bucket[i].end);
+                    }
+                }
+                std::sort(result.begin(), result.end());
+                return result;
+            }
+
+            /// no. of pending items
+            int size() const {
+                return count;
+            }
+
+        private:
+            class Range {
+            public:
+                int begin;
+                int end;
+
+                // The no. of takes happened before it is queued
+                int tick;
+            };
+
+            QMap<int, QList<Range>> buckets;
+
+            int count;
+
+            int tick;
+        };
+
+        // ItemStore holds the items of a pipeline stage. The initial sequence is kept as the implicitly shared QList, so it is never copied.
+        // Items added later are appended to a deque. Neither of them moves an item once it is stored, so workers could read the items by pointer.
+        // Once a prefix of the items is finished, it is released, so the memory is bounded by the unfinished items of a long-running pipeline.
+        template <typename ARG>
+        class ItemStore {
+        public:
+            ItemStore() : initialSize(0), first(0) {
+            }
+
+            /// Take the initial sequence. It must be called before any item is appended.
+            void assign(const QList<ARG>& sequence) {
+                initial = sequence;
+                initialSize = sequence.size();
+            }
+
+            void append(const ARG& value) {
+                appended.push_back(value);
+            }
+
+            /// The item at index. It must not be released.
+            const ARG& at(int index) const {
+                return index < initialSize ? initial.at(index) : appended[index - qMax(first, initialSize)];
+            }
+
+            /// no. of items ever stored
+            int size() const {
+                return qMax(first, initialSize) + (int) appended.size();
+            }
+
+            /// no. of items of the initial sequence
+            int initialCount() const {
+                return initialSize;
+            }
+
+            /// The first item which is not released
+            int begin() const {
+                return first;
+            }
+
+            /// Mark the items [index, index + count) finished. No task may read them anymore. The finished prefix is released.
+            void finish(int index, int count) {
+                if (index != first) {
+                    finished.insert(index, index + count);
+                    return;
+                }
+
+                int end = index + count;
+                while (!finished.isEmpty() && finished.firstKey() == end) {
+                    end = finished.take(end);
+                }
+
+                int from = qMax(first, initialSize);
+                if (end > from) {
+                    appended.erase(appended.begin(), appended.begin() + (end - from));
+                }
+                if (end >= initialSize) {
+                    initial = QList<ARG>();
+                }
+                first = end;
+            }
+
+        private:
+            QList<ARG> initial;
+
+            int initialSize;
+
+            std::deque<ARG> appended;
+
+            /// The items before first are released
+            int first;
+
+            /// Finished ranges after first. Keyed by the begin of a range and the value is its end.
+            QMap<int, int> finished;
+        };
+
+        // ItemRecords keeps a value per item of an ItemStore. The values of released items are dropped along with the items.
+        template <typename T>
+        class ItemRecords {
+        public:
+            ItemRecords() : first(0) {
+            }
+
+            void append(const T& value, int count = 1) {
+                values.insert(values.end(), count, value);
+            }
+
+            T& operator[](int index) {
+                return values[index - first];
+            }
+
+            const T& operator[](int index) const {
+                return values[index - first];
+            }
+
+            /// Drop the values of the items before index
+            void release(int index) {
+                int size = qMin(index - first, (int) values.size());
+                if (size > 0) {
+                    values.erase(values.begin(), values.begin() + size);
+                }
+                first = index;
+            }
+
+        private:
+            std::deque<T> values;
+
+            int first;
+        };
+
+        // ChunkResult holds the results of a contiguous range of items executed by a single task.
+        template <typename R>
+        class ChunkResult {
+        public:
+            ChunkResult() : count(0), elapsed(0), priority(0) {
+            }
+
+            /// Run the items in [begin, end) of the input. The items are passed to the functor by reference.
+            template <typename Functor, typename Input>
+            void run(Functor functor, const Input& input, int begin, int end) {
+                QElapsedTimer timer;
+                timer.start();
+                values.reserve(end - begin);
+                for (int i = begin ; i < end ; i++) {
+                    values.append(functor(input.at(i)));
+                }
+                count = end - begin;
+                elapsed = timer.nsecsElapsed();
+            }
+
+            /// Take the results of the finished futures of an asynchronous task
+            void collect(const QVector<QFuture<R>>& futures) {
+                values.reserve(futures.size());
+                for (int i = 0 ; i < futures.size() ; i++) {
+                    values.append(futures[i].result());
+                }
+                count = futures.size();
+            }
+
+            /// Report the values starting from index by a single batch. Append them to the end if index is -1.
+            void report(CustomDeferred<R>& defer, int index) const {
+                if (values.isEmpty()) {
+                    return;
+                }
+                defer.reportResults(values, index);
+            }
+
+            /// Report a single value at index
+            void reportAt(CustomDeferred<R>& defer, int offset, int index) const {
+                defer.reportResult(values.at(offset), index);
+            }
+
+            void complete(AsyncFuture::Deferred<R> task, int offset) const {
+                task.complete(values.at(offset));
+            }
+
+            /// Feed the values to the next stage. origin(offset) returns the source index of a value.
+            template <typename Stage, typename Origin>
+            void forward(Stage* stage, Origin origin) const {
+                for (int i = 0 ; i < values.size() ; i++) {
+                    stage->_feed(origin(i), values.at(i), priority);
+                }
+            }
+
+            QVector<R> values;
+
+            int count;
+
+            // Time spent in nsec
+            qint64 elapsed;
+
+            // The priority of the task
+            int priority;
+        };
+
+        template <>
+        class ChunkResult<void> {
+        public:
+            ChunkResult() : count(0), elapsed(0), priority(0) {
+            }
+
+            template <typename Functor, typename Input>
+            void run(Functor functor, const Input& input, int begin, int end) {
+                QElapsedTimer timer;
+                timer.start();
+                for (int i = begin ; i < end ; i++) {
+                    functor(input.at(i));
+                }
+                count = end - begin;
+                elapsed = timer.nsecsElapsed();
+            }
+
+            void collect(const QVector<QFuture<void>>& futures) {
+                count = futures.size();
+            }
+
+            void report(CustomDeferred<void>& defer, int index) const {
+                Q_UNUSED(defer);
+                Q_UNUSED(index);
+            }
+
+            void reportAt(CustomDeferred<void>& defer, int offset, int index) const {
+                Q_UNUSED(defer);
+                Q_UNUSED(offset);
+                Q_UNUSED(index);
+            }
+
+            void complete(AsyncFuture::Deferred<void> task, int offset) const {
+                Q_UNUSED(offset);
+                task.complete();
+            }
+
+            template <typename Stage, typename Origin>
+            void forward(Stage* stage, Origin origin) const {
+                Q_UNUSED(stage);
+                Q_UNUSED(origin);
+            }
+
+            int count;
+
+            qint64 elapsed;
+
+            int priority;
+        };
+
+        // PipelineLink connects a stage of a pipeline to its neighbours. All the functions must be called on the main thread.
+        class PipelineLink {
+        public:
+            virtual ~PipelineLink() {
+            }
+
+            /// True if the buffer of the stage is full. The previous stage should hold its items.
+            virtual bool _isFull() const = 0;
+
+            /// The next stage has space again
+            virtual void _resume() = 0;
+
+            virtual void _cancel() = 0;
+
+            /// The previous stage is finished. No more items will be fed.
+            virtual void _upstreamFinished() = 0;
+
+            virtual void _setUpstream(PipelineLink* upstream) = 0;
+        };
+
+        // PipelineInput is the interface to add items to the first stage of a pipeline, or feed items from the previous stage.
+        template <typename ARG>
+        class PipelineInput : public PipelineLink {
+        public:
+            /// Add an item finished by the previous stage. source is the index of the item in the first stage.
+            virtual void _feed(int source, ARG value, int priority) = 0;
+
+            /// Append an item and return its index. It returns -1 and releases the reserved amount if it is rejected.
+            virtual int _append(ARG value, qint64 amount, int priority) = 0;
+
+            /// Append a list of items and return the index of the first one, or -1 if they are rejected.
+            virtual int _append(QList<ARG> values, QList<qint64> amounts, int priority) = 0;
+
+            /// The functions below could be called by any thread.
+
+            virtual qint64 costOf(const ARG& value) const = 0;
+
+            /// Reserve the space regardless of the capacity
+            virtual void reserve(qint64 amount) = 0;
+
+            virtual bool tryReserve(qint64 amount) = 0;
+
+            /// Block the calling thread until the space is reserved or the pipeline stops accepting items
+            virtual void waitReserve(qint64 amount) = 0;
+
+            virtual QFuture<void> spaceAvailable() = 0;
+
+            virtual void setCostFunction(std::function<qint64(const ARG&)> function) = 0;
+
+            virtual void close() = 0;
+        };
+
+        template <>
+        class PipelineInput<void> : public PipelineLink {
+        };
+
+        // PipelineOutput is the interface of the last stage of a pipeline
+        template <typename RET>
+        class PipelineOutput {
+        public:
+            virtual ~PipelineOutput() {
+            }
+
+            virtual QFuture<RET> future() = 0;
+
+            virtual int sourceIndexAt(int resultIndex) const = 0;
+
+            /// It could be called by any thread
+            virtual Metrics metrics() const = 0;
+
+            /// Complete the task once the item of source index is finished by this stage. It must be called on the main thread.
+            virtual void _expect(int source, AsyncFuture::Deferred<RET> task) = 0;
+
+            /// Feed the results to the next stage. It must be called on the main thread.
+            virtual void _connect(QSharedPointer<PipelineInput<RET>> stage) = 0;
+        };
+
+        template <typename RET, typename ARG>
+        class PipelineContext : public PipelineInput<ARG>, public PipelineOutput<RET> {
+        private:
+            /// Variables access is not allowed out of the main thread except the initialization
+
+            ExecutorRef executor;
+            Worker<RET, ARG> worker;
+
+            /// The worker returning QFuture<RET>. It is called on the main thread and it is null if the worker is synchronous.
+            Worker<QFuture<RET>, ARG> asyncWorker;
+
+            /// It is canceled along with the future. Workers could read it from any thread.
+            CancellationToken token;
+
+            /// The indexes of items waiting to be dispatched
+            PendingQueue pending;
+
+            /// Items are never moved once they are added, so that workers could read them without copying while the main thread appends new items.
+            ItemStore<ARG> input;
+
+            /// The source index of each item fed by the previous stage. It is not used by the first stage.
+            ItemRecords<int> origins;
+
+            /// no. of running tasks
+            int running;
+
+            /// The max. no. of running tasks. 0 if it is only limited by the pool.
+            int maxConcurrency;
+
+            int completedCount;
+
+            GrainSize grainSize;
+
+            TokenBucket rateLimiter;
+
+            /// It is null if metrics are disabled. It is never changed after the initialization, so it could be read by any thread.
+            QSharedPointer<MetricsCollector> collector;
+
+            /// The time of each item being added (MetricsCollector::now())
+            ItemRecords<qint64> enqueuedAt;
+
+            /// A running task which may be duplicated by hedging
+            class Hedge {
+            public:
+                Hedge() : startedAt(0), count(0), priority(0), effectivePriority(0), timer(0), launched(false) {
+                }
+
+                qint64 startedAt;
+                int count;
+                int priority;
+                int effectivePriority;
+
+                /// The timer to check the task. 0 if it is not running.
+                qint64 timer;
+
+                /// Is the duplicate started?
+                bool launched;
+
+                /// Canceled to stop the original task [0] or the duplicate [1] once the other copy wins
+                AsyncFuture::Deferred<void> stops[2];
+            };
+
+            /// The latency of tasks to trigger hedging
+            LatencyPercentile hedgeThreshold;
+
+            AdaptiveLimit adaptiveLimit;
+
+            /// The running tasks keyed by their first item. It is only used if hedging is enabled.
+            QHash<int, Hedge> hedges;
+
+            QElapsedTimer clock;
+
+            /// The timer waiting for the rate limiter. 0 if it is not running.
+            qint64 rateTimer;
+
+            PipelineOptions::ResultOrder resultOrder;
+
+            /// The max. no. of items dispatched ahead of the first unreleased item (StreamingOrderedResults)
+            int reorderCapacity;
+
+            /// no. of items released in input order (StreamingOrderedResults)
+            int released;
+
+            /// Finished chunks waiting for the earlier items. Keyed by the index of their first item. (StreamingOrderedResults)
+            QMap<int, ChunkResult<RET>> reorderBuffer;
+
+            /// The input index of each result (UnorderedResults, or StreamingOrderedResults of a later stage)
+            QVector<int> sources;
+
+            /// The max. total cost of unfinished items. 0 if it is unbounded.
+            qint64 capacity;
+
+            /// The total cost of unfinished items. It is updated by any thread.
+            QAtomicInteger<qint64> usage;
+
+            /// The cost of each item. It is only recorded if the pipeline is bounded.
+            ItemRecords<qint64> costs;
+
+            std::function<qint64(const ARG&)> costFunction;
+
+            /// Set once the pipeline doesn't accept items anymore. It is read by any thread.
+            QAtomicInt stopped;
+
+            QMutex spaceMutex;
+
+            QWaitCondition spaceCondition;
+
+            QList<AsyncFuture::Deferred<void>> spaceWaiters;
+
+            Private::CustomDeferred<RET> defer;
+
+            /// The deferred objects of items created by add(). It is not needed by the items of the initial sequence.
+            QHash<int, AsyncFuture::Deferred<RET>> tasks;
+
+            /// The deferred objects of items which are not fed by the previous stage yet. Keyed by the source index.
+            QHash<int, AsyncFuture::Deferred<RET>> expected;
+
+            /// True until the stage is connected to a previous stage
+            bool headStage;
+
+            /// The previous stage. It is reset once the previous stage is destroyed.
+            PipelineLink* upstream;
+
+            /// The next stage
+            QSharedPointer<PipelineInput<RET>> downstream;
+
+            bool closed;
+
+            bool autoDelete;
+
+            bool deleting;
+
+            void checkDelete() {
+                if (autoDelete && running == 0 && !deleting) {
+                    deleting = true;
+                    runOnMainThreadVoid([=]() {
+                       delete this;
+                    });
+                }
+            }
+
+            /// The max. no. of running tasks allowed by the options
+            int concurrencyLimit() const {
+                if (maxConcurrency > 0) {
+                    return maxConcurrency;
+                }
+                return asyncWorker ? AsyncConcurrency : executor->maxThreadCount();
+            }
+
+            int concurrency() const {
+                int limit = concurrencyLimit();
+                return adaptiveLimit.isEnabled() ? adaptiveLimit.value(limit) : limit;
+            }
+
+            int origin(int index) const {
+                return headStage ? index : origins[index];
+            }
+
+            /// Start a task. Returns false if no more task could be started.
+            bool run() {
+                if (running >= concurrency() || pending.size() == 0) {
+                    return false;
+                }
+
+                if (downstream && downstream->_isFull()) {
+                    // Hold the items until the next stage has space
+                    return false;
+                }
+
+                // Items are not dispatched beyond the reorder buffer (StreamingOrderedResults)
+                int limit = resultOrder == PipelineOptions::StreamingOrderedResults ? released + reorderCapacity : inputSize();
+
+                int size = grainSize.next(pending.size(), concurrency());
+                if (rateLimiter.isLimited()) {
+                    size = rateLimiter.available(size);
+                    if (size <= 0) {
+                        waitForRate();
+                        return false;
+                    }
+                }
+
+                int index, count, priority, effectivePriority;
+                if (!pending.take(size, limit, &index, &count, &priority, &effectivePriority)) {
+                    return false;
+                }
+
+                if (rateLimiter.isLimited()) {
+                    rateLimiter.consume(count);
+                }
+
+                if (MetricsCollector::Enabled) {
+                    qint64 now = collector->now();
+                    qint64 waitTime = 0;
+                    for (int i = index ; i < index + count ; i++) {
+                        waitTime += now - enqueuedAt[i];
+                    }
+                    collector->dispatched(count, waitTime);
+                }
+
+                running++;
+
+                CancellationToken token = this->token;
+                if (hedgeThreshold.isEnabled()) {
+                    Hedge& hedge = hedges[index];
+                    hedge.startedAt = clock.nsecsElapsed();
+                    hedge.count = count;
+                    hedge.priority = priority;
+                    hedge.effectivePriority = effectivePriority;
+                    token = token.linked(hedge.stops[0].future());
+                    watchHedge(index);
+                }
+
+                startTask(index, count, priority, effectivePriority, token, false);
+                return true;
+            }
+
+            /// Run the items [index, index + count) on the executor. The results inherit priority, and the executor runs the task by
+            /// effectivePriority.
+            void startTask(int index, int count, int priority, int effectivePriority, CancellationToken token, bool duplicate) {
+                if (asyncWorker) {
+                    startAsyncTask(index, count, priority, token, duplicate);
+                    return;
+                }
+
+                QVector<const ARG*> values;
+                values.reserve(count);
+                for (int i = index ; i < index + count ; i++) {
+                    values << &input.at(i);
+                }
+
+                auto worker = this->worker;
+                auto collector = this->collector;
+                qint64 dispatchedAt = clock.nsecsElapsed();
+                executor->start([=]() {
+                    ChunkResult<RET> chunk;
+                    chunk.priority = priority;
+                    chunk.run([&](const ARG* value) {
+                        return worker(*value, token);
+                    }, values, 0, values.size());
+
+                    qint64 finishedAt = 0;
+                    if (MetricsCollector::Enabled) {
+                        collector->executed(chunk.count, chunk.elapsed);
+                        finishedAt = collector->now();
+                    }
+
+                    runOnMainThreadVoid([=]() {
+                        onFinished(index, chunk, dispatchedAt, finishedAt, duplicate);
+                    });
+                }, effectivePriority);
+            }
+
+            /// Call the asynchronous worker per item of [index, index + count) on the main thread. The task is finished once all the
+            /// returned futures are finished, so it doesn't hold any thread while they are running.
+            void startAsyncTask(int index, int count, int priority, CancellationToken token, bool duplicate) {
+                qint64 dispatchedAt = clock.nsecsElapsed();
+                QVector<QFuture<RET>> futures;
+                futures.reserve(count);
+                for (int i = index ; i < index + count ; i++) {
+                    futures << asyncWorker(input.at(i), token);
+                }
+
+                // The callbacks of observe() are called on the main thread
+                QSharedPointer<int> remaining = QSharedPointer<int>::create(count);
+                QSharedPointer<bool> failed = QSharedPointer<bool>::create(false);
+                auto collector = this->collector;
+
+                auto settle = [=]() {
+                    if (--(*remaining) > 0) {
+                        return;
+                    }
+
+                    if (*failed) {
+                        onAsyncCanceled(index, count);
+                        return;
+                    }
+
+                    ChunkResult<RET> chunk;
+                    chunk.priority = priority;
+                    chunk.collect(futures);
+                    chunk.elapsed = clock.nsecsElapsed() - dispatchedAt;
+
+                    qint64 finishedAt = 0;
+                    if (MetricsCollector::Enabled) {
+                        collector->executed(chunk.count, chunk.elapsed);
+                        finishedAt = collector->now();
+                    }
+                    onFinished(index, chunk, dispatchedAt, finishedAt, duplicate);
+                };
+
+                for (int i = 0 ; i < futures.size() ; i++) {
+                    AsyncFuture::observe(futures[i]).subscribe(settle, [=]() {
+                        *failed = true;
+                        settle();
+                    });
+                }
+            }
+
+            /// A future returned by the asynchronous worker is canceled. It cancels the pipeline unless the other copy of the task has won.
+            void onAsyncCanceled(int index, int count) {
+                running--;
+
+                bool lost = false;
+                if (hedgeThreshold.isEnabled()) {
+                    auto iter = hedges.find(index);
+                    if (iter == hedges.end()) {
+                        lost = true;
+                    } else {
+                        if (iter->timer != 0) {
+                            TimerWheel::instance()->cancel(iter->timer);
+                        }
+                        hedges.erase(iter);
+                    }
+                }
+
+                if (lost) {
+                    releaseItems(index, count);
+                } else {
+                    defer.cancel();
+                }
+                proceed();
+            }
+
+            /// Check the task once it runs longer than the hedge threshold
+            void watchHedge(int index) {
+                qint64 threshold = hedgeThreshold.value();
+                if (threshold < 0) {
+                    return;
+                }
+
+                int msec = (int) qMax<qint64>(1, (threshold + 999999) / 1000000);
+                hedges[index].timer = TimerWheel::instance()->start(msec, [=]() {
+                    hedge(index);
+                });
+            }
+
+            /// Start a duplicate of a slow task if a thread is idle
+            void hedge(int index) {
+                auto iter = hedges.find(index);
+                if (iter == hedges.end()) {
+                    return;
+                }
+                iter->timer = 0;
+
+                if (iter->launched || defer.future().isFinished() || defer.future().isCanceled()) {
+                    return;
+                }
+
+                if (running >= concurrency()) {
+                    // No idle thread. Check it again later.
+                    watchHedge(index);
+                    return;
+                }
+
+                iter->launched = true;
+                running++;
+                if (MetricsCollector::Enabled) {
+                    collector->hedged();
+                }
+                startTask(index, iter->count, iter->priority, iter->effectivePriority, token.linked(iter->stops[1].future()), true);
+            }
+
+            /// A task is finished. Returns false if the other copy of the task has finished already.
+            /// otherRunning is set if the other copy is still running, so its items must not be released yet.
+            bool onHedgeFinished(int index, bool duplicate, bool* otherRunning) {
+                auto iter = hedges.find(index);
+                if (iter == hedges.end()) {
+                    return false;
+                }
+
+                Hedge hedge = iter.value();
+                hedges.erase(iter);
+
+                if (hedge.timer != 0) {
+                    TimerWheel::instance()->cancel(hedge.timer);
+                }
+
+                if (hedge.launched) {
+                    // Stop the other copy
+                    *otherRunning = true;
+                    hedge.stops[duplicate ? 0 : 1].cancel();
+                    if (duplicate && MetricsCollector::Enabled) {
+                        collector->hedgeWon();
+                    }
+                } else {
+                    // Duplicates are not counted as they are started late
+                    hedgeThreshold.add(clock.nsecsElapsed() - hedge.startedAt);
+                }
+                return true;
+            }
+
+            /// Resume the dispatch once the rate limiter has a token. It doesn't hold any thread of the pool.
+            void waitForRate() {
+                if (rateTimer != 0) {
+                    return;
+                }
+
+                rateTimer = TimerWheel::instance()->start(rateLimiter.waitTime(), [=]() {
+                    rateTimer = 0;
+                    _resume();
+                });
+            }
+
+            /// A chunk dispatched at dispatchedAt (clock) is finished by a worker at finishedAt (MetricsCollector::now()). It is called on the main thread.
+            void onFinished(int index, const ChunkResult<RET>& chunk, qint64 dispatchedAt, qint64 finishedAt, bool duplicate) {
+                bool otherRunning = false;
+                if (hedgeThreshold.isEnabled() && !onHedgeFinished(index, duplicate, &otherRunning)) {
+                    // The other copy has won. Drop the result. The pipeline may be closed after the winner has finished the last item.
+                    running--;
+                    releaseItems(index, chunk.count);
+                    proceed();
+                    return;
+                }
+
+                int count = chunk.count;
+                if (MetricsCollector::Enabled) {
+                    collector->finished(count, collector->now() - finishedAt);
+                }
+                int progressValue = defer.future().progressValue();
+                publish(index, chunk);
+
+                if (!tasks.isEmpty()) {
+                    for (int i = 0 ; i < count ; i++) {
+                        if (tasks.contains(index + i)) {
+                            chunk.complete(tasks.take(index + i), i);
+                        }
+                    }
+                }
+
+                if (capacity > 0) {
+                    qint64 amount = 0;
+                    for (int i = 0 ; i < count ; i++) {
+                        amount += costs[index + i];
+                        // Released already. The items may still be read by the other copy of a hedged task.
+                        costs[index + i] = 0;
+                    }
+                    release(amount);
+                }
+
+                if (!otherRunning) {
+                    releaseItems(index, count);
+                }
+
+                grainSize.update(count, chunk.elapsed);
+                if (adaptiveLimit.isEnabled() && count > 0) {
+                    adaptiveLimit.update((clock.nsecsElapsed() - dispatchedAt) / count, running, concurrencyLimit());
+                }
+                defer.setProgressValue(progressValue + count);
+                completedCount += count;
+                running--;
+                proceed();
+            }
+
+            /// A task is done. Finish the pipeline once it is closed and all the items are completed, otherwise start the next tasks.
+            void proceed() {
+                if (defer.future().isFinished() || defer.future().isCanceled()) {
+                    checkDelete();
+                    return;
+                }
+
+                if (closed && completedCount == inputSize()) {
+                    finish();
+                    return;
+                }
+                dispatch();
+            }
+
+            /// Release the storage of the finished items [index, index + count). No task may read them anymore.
+            void releaseItems(int index, int count) {
+                input.finish(index, count);
+                costs.release(input.begin());
+                origins.release(input.begin());
+                enqueuedAt.release(input.begin());
+            }
+
+            /// Start tasks until the pool is full
+            void dispatch() {
+                while (run()) {
+                }
+            }
+
+            /// Report the results of a finished chunk according to the result order
+            void publish(int index, const ChunkResult<RET>& chunk) {
+                switch (resultOrder) {
+                case PipelineOptions::UnorderedResults:
+                    for (int i = 0 ; i < chunk.count ; i++) {
+                        sources << origin(index + i);
+                    }
+                    chunk.report(defer, -1);
+                    forward(index, chunk);
+                    break;
+
+                case PipelineOptions::StreamingOrderedResults:
+                    reorderBuffer[index] = chunk;
+                    while (reorderBuffer.contains(released)) {
+                        ChunkResult<RET> head = reorderBuffer.take(released);
+                        if (!headStage) {
+                            for (int i = 0 ; i < head.count ; i++) {
+                                sources << origin(released + i);
+                            }
+                        }
+                        head.report(defer, released);
+                        forward(released, head);
+                        released += head.count;
+                    }
+                    break;
+
+                default:
+                    if (headStage) {
+                        chunk.report(defer, index);
+                    } else {
+                        // Keep the results of the later stages at the index of their input in the first stage
+                        for (int i = 0 ; i < chunk.count ; i++) {
+                            chunk.reportAt(defer, i, origins[index + i]);
+                        }
+                    }
+                    forward(index, chunk);
+                    break;
+                }
+            }
+
+            /// Feed the results to the next stage
+            void forward(int index, const ChunkResult<RET>& chunk) {
+                if (!downstream) {
+                    return;
+                }
+                chunk.forward(downstream.data(), [=](int offset) {
+                    return origin(index + offset);
+                });
+            }
+
+            void finish() {
+                defer.finish();
+                if (downstream && !defer.future().isCanceled()) {
+                    downstream->_upstreamFinished();
+                }
+                checkDelete();
+            }
+
+            bool isAcceptable() {
+                return !defer.future().isFinished() &&
+                       !defer.future().isCanceled() &&
+                       !closed;
+            }
+
+            int inputSize() const {
+                return input.size();
+            }
+
+            void append(const ARG& value, qint64 amount) {
+                input.append(value);
+                if (capacity > 0) {
+                    costs.append(amount);
+                }
+                if (MetricsCollector::Enabled) {
+                    enqueuedAt.append(collector->now());
+                    collector->enqueued(1);
+                }
+            }
+
+            void release(qint64 amount) {
+                if (amount != 0) {
+                    usage.fetchAndAddOrdered(-amount);
+                }
+                notifySpace();
+            }
+
+            /// Charge the unfinished items of the initial sequence by the cost function. It must be called on the main thread.
+            void recharge() {
+                qint64 delta = 0;
+                for (int i = input.begin() ; i < input.initialCount() ; i++) {
+                    if (costs[i] == 0) {
+                        // Finished already
+                        continue;
+                    }
+                    qint64 cost = costFunction(input.at(i));
+                    delta += cost - costs[i];
+                    costs[i] = cost;
+                }
+                if (delta != 0) {
+                    usage.fetchAndAddOrdered(delta);
+                    notifySpace();
+                }
+            }
+
+            /// Wake up the producers waiting for space. It must be called on the main thread.
+            void notifySpace() {
+                if (capacity <= 0 || (usage.loadAcquire() >= capacity && stopped.load() == 0)) {
+                    return;
+                }
+
+                if (upstream) {
+                    upstream->_resume();
+                }
+
+                QList<AsyncFuture::Deferred<void>> waiters = spaceWaiters;
+                spaceWaiters.clear();
+                for (int i = 0 ; i < waiters.size() ; i++) {
+                    waiters[i].complete();
+                }
+
+                QMutexLocker locker(&spaceMutex);
+                spaceCondition.wakeAll();
+            }
+
+            /// The pipeline doesn't accept items anymore
+            void stop() {
+                stopped.store(1);
+                notifySpace();
+            }
+
+            void _close() {
+                closed = true;
+                stop();
+
+                if (running == 0 && (pending.size() == 0 || defer.future().isCanceled())) {
+                    finish();
+                }
+            }
+
+            void init(const PipelineOptions& options) {
+                capacity = options.capacity();
+                maxConcurrency = options.maxConcurrency();
+                rateLimiter = TokenBucket(options.rateLimit(), options.rateBurst());
+                rateTimer = 0;
+                token = CancellationToken(defer.future());
+                hedgeThreshold = LatencyPercentile(options.hedgingPercentile());
+                adaptiveLimit = AdaptiveLimit(options.adaptiveConcurrency());
+                clock.start();
+                if (MetricsCollector::Enabled) {
+                    collector = QSharedPointer<MetricsCollector>::create();
+                }
+                resultOrder = options.resultOrder();
+                reorderCapacity = options.reorderBufferSize() > 0 ? options.reorderBufferSize() : concurrencyLimit() * 4;
+                completedCount = 0;
+                running = 0;
+                closed = false;
+                autoDelete = false;
+                deleting = false;
+                released = 0;
+                headStage = true;
+                upstream = nullptr;
+                defer.subscribe([]() {}, [=](){
+                    closed = true;
+                    QVector<QPair<int, int>> ranges = pending.ranges();
+                    for (auto iter = tasks.begin() ; iter != tasks.end() ; iter++) {
+                        // The last range begins at or before the index
+                        auto range = std::upper_bound(ranges.begin(), ranges.end(), iter.key(), [](int index, const QPair<int, int>& range) {
+                            return index < range.first;
+                        });
+                        if (range != ranges.begin() && iter.key() < (range - 1)->second) {
+                            iter.value().cancel();
+                        }
+                    }
+                    for (auto iter = expected.begin() ; iter != expected.end() ; iter++) {
+                        iter.value().cancel();
+                    }
+                    expected.clear();
+
+                    // All the stages share the same fate
+                    if (upstream) {
+                        upstream->_cancel();
+                    }
+                    if (downstream) {
+                        downstream->_cancel();
+                    }
+
+                    stop();
+                    checkDelete();
+                });
+
+            }
+
+            /// Add the initial sequence and start dispatching it
+            void setup(QList<ARG> sequence) {
+                input.assign(sequence);
+                pending.enqueue(0, sequence.size(), 0);
+                if (MetricsCollector::Enabled) {
+                    enqueuedAt.append(collector->now(), sequence.size());
+                    collector->enqueued(sequence.size());
+                }
+                if (capacity > 0) {
+                    // Every item costs 1 until setCostFunction() measures them
+                    costs.append(1, sequence.size());
+                    usage.store(sequence.size());
+                }
+                defer.setProgressRange(0, sequence.size());
+                dispatch();
+            }
+
+        public:
+            PipelineContext(ExecutorRef executor, Worker<RET, ARG> worker, const PipelineOptions& options = PipelineOptions()) :
+                executor(executor), worker(worker), grainSize(options.grainSize()) {
+                init(options);
+            }
+
+            PipelineContext(ExecutorRef executor, Worker<RET, ARG> worker, QList<ARG> sequence, const PipelineOptions& options = PipelineOptions()) :
+                executor(executor), worker(worker), grainSize(options.grainSize()) {
+                init(options);
+                setup(sequence);
+            }
+
+            PipelineContext(ExecutorRef executor, Worker<QFuture<RET>, ARG> asyncWorker, QList<ARG> sequence, const PipelineOptions& options = PipelineOptions()) :
+                executor(executor), asyncWorker(asyncWorker), grainSize(options.grainSize()) {
+                init(options);
+                setup(sequence);
+            }
+
+            ~PipelineContext() {
+                if (rateTimer != 0) {
+                    TimerWheel::instance()->cancel(rateTimer);
+                }
+                for (auto iter = hedges.begin() ; iter != hedges.end() ; iter++) {
+                    if (iter->timer != 0) {
+                        TimerWheel::instance()->cancel(iter->timer);
+                    }
+                }
+                if (downstream) {
+                    downstream->_setUpstream(nullptr);
+                }
+            }
+
+            bool _isFull() const override {
+                return capacity > 0 && usage.loadAcquire() >= capacity;
+            }
+
+            void _resume() override {
+                if (!defer.future().isFinished() && !defer.future().isCanceled()) {
+                    dispatch();
+                }
+            }
+
+            void _cancel() override {
+                defer.cancel();
+            }
+
+            void _upstreamFinished() override {
+                _close();
+            }
+
+            void _setUpstream(PipelineLink* link) override {
+                upstream = link;
+                if (link) {
+                    headStage = false;
+                }
+            }
+
+            void _feed(int source, ARG value, int priority) override {
+                if (!isAcceptable()) {
+                    return;
+                }
+
+                qint64 amount = costOf(value);
+                usage.fetchAndAddOrdered(amount);
+                if (expected.contains(source)) {
+                    tasks[inputSize()] = expected.take(source);
+                }
+                origins.append(source);
+                pending.enqueue(inputSize(), 1, priority);
+                append(value, amount);
+                defer.setProgressRange(0, inputSize());
+                dispatch();
+            }
+
+            int _append(ARG value, qint64 amount, int priority) override {
+                if (!isAcceptable()) {
+                    release(amount);
+                    return -1;
+                }
+
+                int index = inputSize();
+                pending.enqueue(index, 1, priority);
+                append(value, amount);
+                defer.setProgressRange(0, inputSize());
+                dispatch();
+                return index;
+            }
+
+            int _append(QList<ARG> values, QList<qint64> amounts, int priority) override {
+                qint64 total = 0;
+                for (int i = 0 ; i < amounts.size() ; i++) {
+                    total += amounts[i];
+                }
+
+                if (!isAcceptable()) {
+                    release(total);
+                    return -1;
+                }
+
+                int index = inputSize();
+                pending.enqueue(index, values.size(), priority);
+                for (int i = 0 ; i < values.size() ; i++) {
+                    append(values[i], amounts[i]);
+                }
+                defer.setProgressRange(0, inputSize());
+                dispatch();
+                return index;
+            }
+
+            void _expect(int source, AsyncFuture::Deferred<RET> task) override {
+                if (headStage) {
+                    tasks[source] = task;
+                    return;
+                }
+
+                if (defer.future().isCanceled()) {
+                    task.cancel();
+                    return;
+                }
+                expected[source] = task;
+            }
+
+            void _connect(QSharedPointer<PipelineInput<RET>> stage) override {
+                downstream = stage;
+                stage->_setUpstream(this);
+
+                if (defer.future().isCanceled()) {
+                    stage->_cancel();
+                } else if (defer.future().isFinished()) {
+                    stage->_upstreamFinished();
+                }
+            }
+
+            qint64 costOf(const ARG& value) const override {
+                if (capacity <= 0) {
+                    return 0;
+                }
+                return costFunction ? costFunction(value) : 1;
+            }
+
+            void reserve(qint64 amount) override {
+                usage.fetchAndAddOrdered(amount);
+            }
+
+            /// Reserve the space for an item. It fails if the pipeline is full, unless it is empty. It could be called by any thread.
+            bool tryReserve(qint64 amount) override {
+                qint64 current = usage.loadAcquire();
+                do {
+                    if (capacity > 0 && current > 0 && current + amount > capacity) {
+                        return false;
+                    }
+                } while (!usage.testAndSetOrdered(current, current + amount, current));
+                return true;
+            }
+
+            void waitReserve(qint64 amount) override {
+                QMutexLocker locker(&spaceMutex);
+                while (!tryReserve(amount)) {
+                    if (stopped.load()) {
+                        // It will be rejected anyway
+                        reserve(amount);
+                        break;
+                    }
+                    spaceCondition.wait(&spaceMutex);
+                }
+            }
+
+            QFuture<void> spaceAvailable() override {
+                auto res = AsyncFuture::Deferred<void>();
+                runOnMainThreadVoid([=]() {
+                    if (capacity <= 0 || usage.loadAcquire() < capacity || stopped.load()) {
+                        AsyncFuture::Deferred<void> d = res;
+                        d.complete();
                         return;
                     }
-                    run();
+                    spaceWaiters << res;
+                });
+                return res.future();
+            }
+
+            /// It must be called before adding any item. The unfinished items of the initial sequence are measured again.
+            void setCostFunction(std::function<qint64(const ARG&)> function) override {
+                costFunction = function;
+                if (capacity <= 0 || !function || input.initialCount() == 0) {
+                    return;
+                }
+
+                if (QThread::currentThread() == QCoreApplication::instance()->thread()) {
+                    recharge();
+                } else {
+                    runOnMainThreadVoid([=]() {
+                        recharge();
+                    });
+                }
+            }
+
+            QFuture<RET> future() override {
+                return defer.future();
+            }
+
+            /// The index of input of a result. It must be called on the main thread.
+            int sourceIndexAt(int resultIndex) const override {
+                switch (resultOrder) {
+                case PipelineOptions::UnorderedResults:
+                    return sources.value(resultIndex, -1);
+                case PipelineOptions::StreamingOrderedResults:
+                    // Results are released in the order of arrival from the previous stage
+                    return headStage ? resultIndex : sources.value(resultIndex, -1);
+                default:
+                    return resultIndex;
+                }
+            }
+
+            Metrics metrics() const override {
+                return collector ? collector->snapshot() : Metrics();
+            }
+
+            /// Close the pipeline. No more tasks could be added. The contained future will be terminated automatically once all the tasks finished.
+            void close() override {
+                runOnMainThreadVoid([=]() {
+                    _close();
                 });
             }
 
-            void _add(AsyncFuture::Deferred<RET> task, ARG value) {
-                if (defer.future().isFinished() ||
-                    defer.future().isCanceled() ||
-                    closed) {
-                    task.cancel();
+            /// The worker is a Worker<RET, ARG> or an asynchronous Worker<QFuture<RET>, ARG>
+            template <typename W>
+            static QSharedPointer<PipelineContext<RET,ARG>> create(ExecutorRef executor, W worker, QList<ARG> input, const PipelineOptions& options = PipelineOptions()) {
+
+                auto deleter = [](PipelineContext<RET,ARG> *object) {
+                    runOnMainThreadVoid([=]() {
+                        object->autoDelete = true;
+                        object->_close();
+                    });
+                };
+
+                QSharedPointer<PipelineContext<RET,ARG>> ptr(new PipelineContext<RET,ARG>(executor, worker, input, options), deleter);
+                return ptr;
+            }
+        };
+
+
+        // WorkerContext runs a range of indexes on a thread pool. Every worker claims the next chunk of indexes from an atomic counter
+        // and reports the results by itself. The main thread is only notified to update the progress and finish the future.
+        template <typename T>
+        class WorkerContext {
+        public:
+            WorkerContext(ExecutorRef executor, int size, int grainSize) :
+                executor(executor), size(size), workers(qBound(1, executor->maxThreadCount(), qMax(size, 1))), pass(0), grainSize(grainSize), passSize(0),
+                positions(new Position[workers]) {
+            }
+
+            virtual ~WorkerContext() {
+            }
+
+            QFuture<T> future() {
+                return defer.future();
+            }
+
+            static void start(QSharedPointer<WorkerContext<T>> context) {
+                context->defer.setProgressRange(0, context->size);
+                startPass(context, 0, context->size);
+            }
+
+        protected:
+            /// Process the items in [begin, end) of the current pass. It is called by worker threads.
+            virtual void process(int runner, int begin, int end) = 0;
+
+            /// The runner has no more item to process in the current pass. It is called by the worker thread.
+            virtual void leave(int runner) {
+                Q_UNUSED(runner);
+            }
+
+            /// The current pass is finished. Return the no. of items of the next pass, or -1 if there is no more pass.
+            /// It is called by the last worker of the pass.
+            virtual int nextPass() {
+                return -1;
+            }
+
+            /// The items before end are finished in the first pass. It is called by the main thread along with the progress.
+            virtual void progress(int end) {
+                Q_UNUSED(end);
+            }
+
+            /// All the passes are finished. It is called by the main thread.
+            virtual void complete() {
+                defer.finish();
+            }
+
+            ExecutorRef executor;
+
+            int size;
+
+            /// no. of workers
+            int workers;
+
+            /// The current pass. The first pass processes the input items and reports the progress.
+            int pass;
+
+            Private::CustomDeferred<T> defer;
+
+        private:
+            static void startPass(QSharedPointer<WorkerContext<T>> context, int pass, int size) {
+                context->pass = pass;
+                context->passSize = size;
+                context->next.store(0);
+
+                if (size == 0) {
+                    endPass(context);
                     return;
                 }
 
-                input << value;
-                tasks << task;
-                defer.setProgressRange(0, tasks.size());
-                if (running < pool->maxThreadCount()) {
-                    run();
+                context->running.store(context->workers);
+
+                for (int i = 0 ; i < context->workers ; i++) {
+                    context->executor->start([=]() {
+                        WorkerContext<T>::work(context, i);
+                    });
                 }
             }
 
-            void _close() {
-                closed = true;
-
-                if (running == 0 && (next >= tasks.size() || defer.future().isCanceled())) {
-                    defer.finish();
-                    checkDelete();
+            static void endPass(QSharedPointer<WorkerContext<T>> context) {
+                if (!context->defer.future().isCanceled()) {
+                    int size = context->nextPass();
+                    if (size >= 0) {
+                        startPass(context, context->pass + 1, size);
+                        return;
+                    }
                 }
+
+                runOnMainThreadVoid([=]() {
+                    context->finish();
+                });
             }
 
-            void init() {
-                completedCount = 0;
-                next = 0;
-                running = 0;
-                closed = false;
-                autoDelete = false;
-                defer.subscribe([]() {}, [=](){
-                    closed = true;
-                    for (int i = next ; i < tasks.size(); i++) {
-                        tasks[i].cancel();
+            static void work(QSharedPointer<WorkerContext<T>> context, int runner) {
+                // Items of the later passes are claimed one by one
+                bool first = context->pass == 0;
+                GrainSize grainSize(first ? context->grainSize : 1);
+                QElapsedTimer timer;
+                int size = context->passSize;
+                QAtomicInt& position = context->positions[runner].value;
+
+                while (!context->defer.future().isCanceled()) {
+                    int remaining = size - context->next.load();
+                    if (remaining <= 0) {
+                        break;
                     }
-                    checkDelete();
+
+                    int count = grainSize.next(remaining, context->workers);
+                    if (first) {
+                        // The next index is a lower bound of the chunk to be claimed. Every item before it claimed by this runner is finished.
+                        position.fetchAndStoreOrdered(context->next.load());
+                    }
+                    int begin = context->next.fetchAndAddOrdered(count);
+                    if (begin >= size) {
+                        break;
+                    }
+                    int end = qMin(begin + count, size);
+                    if (first) {
+                        position.fetchAndStoreOrdered(begin);
+                    }
+
+                    timer.start();
+                    context->process(runner, begin, end);
+                    grainSize.update(end - begin, timer.nsecsElapsed());
+
+                    if (first) {
+                        context->completed.fetchAndAddOrdered(end - begin);
+                        position.fetchAndStoreOrdered(end);
+                        notifyProgress(context);
+                    }
+                }
+
+                if (first) {
+                    position.fetchAndStoreOrdered(size);
+                }
+                context->leave(runner);
+
+                if (context->running.fetchAndAddOrdered(-1) == 1) {
+                    endPass(context);
+                }
+            }
+
+            static void notifyProgress(QSharedPointer<WorkerContext<T>> context) {
+                // Coalesce the notifications. Only one could be pending at a time.
+                if (!context->progressPending.testAndSetOrdered(0, 1)) {
+                    return;
+                }
+
+                runOnMainThreadVoid([=]() {
+                    context->progressPending.store(0);
+                    context->defer.setProgressValue(context->completed.load());
+                    context->progress(context->finishedPrefix());
                 });
+            }
+
+            /// All the items before it are finished in the first pass. It is the lowest position of the runners, as the chunks are
+            /// claimed in the order of index and a runner only moves its position past a chunk once the chunk is finished.
+            int finishedPrefix() const {
+                int res = size;
+                for (int i = 0 ; i < workers ; i++) {
+                    res = qMin(res, positions[i].value.loadAcquire());
+                }
+                return res;
+            }
 
+            void finish() {
+                if (defer.future().isCanceled()) {
+                    return;
+                }
+                defer.setProgressValue(completed.load());
+                progress(size);
+                complete();
             }
 
+            int grainSize;
+
+            /// no. of items of the current pass
+            int passSize;
+
+            /// The next index to be claimed
+            QAtomicInt next;
+
+            QAtomicInt completed;
+
+            /// no. of workers not yet left
+            QAtomicInt running;
+
+            QAtomicInt progressPending;
+
+            // The position of a runner in the first pass. It is padded to a cache line, as it is updated per chunk. The padding keeps
+            // the positions of two runners 64 bytes apart without alignas, which plain new[] doesn't honour before C++17.
+            struct Position {
+                QAtomicInt value;
+                char padding[64 - sizeof(QAtomicInt)];
+            };
+
+            /// It is 0 until the runner starts, and size once it leaves the first pass
+            QScopedArrayPointer<Position> positions;
+        };
+
+        template <typename RET, typename ARG>
+        class MappedContext : public WorkerContext<RET> {
         public:
-            PipelineContext(QThreadPool* pool, std::function<RET(ARG)> worker) : pool(pool), worker(worker){
-                init();
+            MappedContext(ExecutorRef executor, Worker<RET, ARG> worker, QList<ARG> input, const PipelineOptions& options) :
+                WorkerContext<RET>(executor, input.size(), options.grainSize()), worker(worker), input(input),
+                // StreamingOrderedResults is served by the ordered path, as it already publishes the finished prefix
+                unordered(options.resultOrder() == PipelineOptions::UnorderedResults), published(0) {
+                token = CancellationToken(this->defer.future());
+                if (!unordered) {
+                    buffer.resize(input.size());
+                }
+            }
+
+            static QFuture<RET> create(ExecutorRef executor, Worker<RET, ARG> worker, QList<ARG> input, const PipelineOptions& options) {
+                QSharedPointer<MappedContext<RET, ARG>> context(new MappedContext<RET, ARG>(executor, worker, input, options));
+                WorkerContext<RET>::start(context);
+                return context->future();
             }
 
-            PipelineContext(QThreadPool* pool, std::function<RET(ARG)> worker, QList<ARG> sequence) : pool(pool), worker(worker){
-                init();
+        protected:
+            void process(int runner, int begin, int end) override {
+                Q_UNUSED(runner);
+                auto run = [&](const ARG& value) {
+                    return worker(value, token);
+                };
 
-                input = sequence;
-                for (int i = 0 ; i < sequence.size() ; i++) {
-                    auto task = AsyncFuture::Deferred<RET>();
-                    tasks << task;
+                if (!unordered) {
+                    buffer.run(run, input, begin, end);
+                    return;
                 }
 
-                defer.setProgressRange(0, sequence.size());
+                ChunkResult<RET> chunk;
+                chunk.run(run, input, begin, end);
+                chunk.report(this->defer, -1);
+            }
 
-                for (int i = 0 ; i < pool->maxThreadCount();i++) {
-                    run();
+            void progress(int end) override {
+                // Publish the finished prefix of the ordered results by a single batch
+                if (!unordered && end > published) {
+                    buffer.publish(this->defer, published, end);
+                    published = end;
                 }
+            }
+
+        private:
+            Worker<RET, ARG> worker;
+            CancellationToken token;
+            const QList<ARG> input;
+            bool unordered;
+
+            /// no. of ordered results published. It is only accessed by the main thread.
+            int published;
+
+            /// The results of OrderedResults and StreamingOrderedResults
+            ResultBuffer<RET> buffer;
+        };
 
+        // ReduceContext accumulates the items into a partial result per worker. Once a worker has no more item, the partial results
+        // are combined in a binary tree: the second worker arriving at a node combines the pair and carries on to the parent node.
+        // The order of reduction is not specified.
+        template <typename T, typename ARG>
+        class ReduceContext : public WorkerContext<T> {
+        public:
+            /// accumulate(result, item) reduces an item into the partial result. It returns false if the item is skipped.
+            ReduceContext(ExecutorRef executor, QList<ARG> input, int grainSize,
+                          std::function<bool(T&, const ARG&)> accumulate,
+                          std::function<void(T&, const T&)> combine) :
+                WorkerContext<T>(executor, input.size(), grainSize), input(input), accumulate(accumulate), combine(combine), levels(0) {
+
+                while ((1 << levels) < this->workers) {
+                    levels++;
+                }
+                partials.resize(this->workers);
+                arrivals.resize(levels * this->workers);
             }
 
-            ~PipelineContext() {
+            static QFuture<T> create(ExecutorRef executor, QList<ARG> input, int grainSize,
+                                     std::function<bool(T&, const ARG&)> accumulate,
+                                     std::function<void(T&, const T&)> combine) {
+                QSharedPointer<ReduceContext<T, ARG>> context(new ReduceContext<T, ARG>(executor, input, grainSize, accumulate, combine));
+                WorkerContext<T>::start(context);
+                return context->future();
             }
 
-            QFuture<RET> add(ARG value) {
-                auto res = AsyncFuture::Deferred<RET>();
-                runOnMainThreadVoid([=]() {
-                    _add(res, value);
-                });
-                return res.future();
+        protected:
+            void process(int runner, int begin, int end) override {
+                Partial& partial = partials[runner];
+                for (int i = begin ; i < end ; i++) {
+                    if (accumulate(partial.value, input.at(i))) {
+                        partial.valid = true;
+                    }
+                }
             }
 
-            QFuture<RET> future() {
-                return defer.future();
+            void leave(int runner) override {
+                int index = runner;
+                for (int step = 1, level = 0 ; step < this->workers ; step *= 2, level++) {
+                    int left = index - index % (2 * step);
+                    int right = left + step;
+                    if (right < this->workers) {
+                        if (arrivals[level * this->workers + left].fetchAndAddOrdered(1) == 0) {
+                            // The other side is not finished yet. It will carry on.
+                            return;
+                        }
+                        merge(partials[left], partials[right]);
+                    }
+                    index = left;
+                }
             }
 
-            /// Close the pipeline. No more tasks could be added. The contained future will be terminated automatically once all the tasks finished.
-            void close() {
-                runOnMainThreadVoid([=]() {
-                    _close();
-                });
+            void complete() override {
+                this->defer.complete(partials[0].value);
             }
 
-            static QSharedPointer<PipelineContext<RET,ARG>> create(QThreadPool* pool, std::function<RET(ARG)> worker, QList<ARG> input) {
+        private:
+            // A partial result is updated per item by its own worker. It takes its own cache line, so the workers don't false-share.
+            class alignas(64) Partial {
+            public:
+                Partial() : value(), valid(false) {
+                }
 
-                auto deleter = [](PipelineContext<RET,ARG> *object) {
-                    runOnMainThreadVoid([=]() {
-                        object->autoDelete = true;
-                        object->_close();
-                    });
-                };
+                T value;
 
-                QSharedPointer<PipelineContext<RET,ARG>> ptr(new PipelineContext<RET,ARG>(pool, worker, input), deleter);
-                return ptr;
+                // True if any item is reduced into the value
+                bool valid;
+            };
+
+            void merge(Partial& result, const Partial& other) {
+                if (!other.valid) {
+                    return;
+                }
+
+                if (!result.valid) {
+                    result = other;
+                    return;
+                }
+
+                combine(result.value, other.value);
             }
+
+            const QList<ARG> input;
+            std::function<bool(T&, const ARG&)> accumulate;
+            std::function<void(T&, const T&)> combine;
+
+            QVector<Partial> partials;
+
+            /// No. of arrivals per node of the tree. Indexed by level * workers + left index
+            QVector<QAtomicInt> arrivals;
+
+            int levels;
         };
 
+        // FilterContext keeps the items accepted by a predicate. The first pass marks the accepted items and counts them per block.
+        // The second pass copies the accepted items of each block into its own range of a contiguous output.
+        template <typename ARG>
+        class FilterContext : public WorkerContext<ARG> {
+        public:
+            FilterContext(ExecutorRef executor, std::function<bool(const ARG&)> predicate, QList<ARG> input, int grainSize) :
+                WorkerContext<ARG>(executor, input.size(), grainSize), predicate(predicate), input(input) {
+
+                // A few blocks per worker, so that the second pass is balanced
+                int count = this->workers * 4;
+                blockSize = qMax(1, (input.size() + count - 1) / count);
+                blocks = (input.size() + blockSize - 1) / blockSize;
+
+                keep.resize(input.size());
+                counts.resize(blocks);
+                offsets.resize(blocks);
+            }
+
+            static QFuture<ARG> create(ExecutorRef executor, std::function<bool(const ARG&)> predicate, QList<ARG> input, int grainSize) {
+                QSharedPointer<FilterContext<ARG>> context(new FilterContext<ARG>(executor, predicate, input, grainSize));
+                WorkerContext<ARG>::start(context);
+                return context->future();
+            }
+
+        protected:
+            void process(int runner, int begin, int end) override {
+                Q_UNUSED(runner);
+                if (this->pass == 0) {
+                    mark(begin, end);
+                } else {
+                    scatter(begin, end);
+                }
+            }
+
+            int nextPass() override {
+                if (this->pass > 0) {
+                    return -1;
+                }
+
+                int total = 0;
+                for (int i = 0 ; i < blocks ; i++) {
+                    offsets[i] = total;
+                    total += counts[i].load();
+                }
+                output.resize(total);
+                return blocks;
+            }
+
+            void complete() override {
+                if (output.size() > 0) {
+                    this->defer.reportResults(output, 0);
+                }
+                this->defer.finish();
+            }
+
+        private:
+            void mark(int begin, int end) {
+                char* flags = keep.data();
+                int block = begin / blockSize;
+                int accepted = 0;
+
+                for (int i = begin ; i < end ; i++) {
+                    if (i / blockSize != block) {
+                        counts[block].fetchAndAddRelaxed(accepted);
+                        block = i / blockSize;
+                        accepted = 0;
+                    }
+                    flags[i] = predicate(input.at(i)) ? 1 : 0;
+                    accepted += flags[i];
+                }
+                counts[block].fetchAndAddRelaxed(accepted);
+            }
+
+            void scatter(int begin, int end) {
+                const char* flags = keep.constData();
+                ARG* values = output.data();
+
+                for (int block = begin ; block < end ; block++) {
+                    int index = offsets[block];
+                    int last = qMin((block + 1) * blockSize, input.size());
+                    for (int i = block * blockSize ; i < last ; i++) {
+                        if (flags[i]) {
+                            values[index++] = input.at(i);
+                        }
+                    }
+                }
+            }
+
+            std::function<bool(const ARG&)> predicate;
+            const QList<ARG> input;
+
+            int blockSize;
+            int blocks;
+
+            /// 1 if the item is accepted
+            QVector<char> keep;
+
+            /// no. of accepted items per block
+            QVector<QAtomicInt> counts;
+
+            /// The position of the first accepted item of a block in the output
+            QVector<int> offsets;
+
+            QVector<ARG> output;
+        };
 
     } // End of Private namespace
 
@@ -347,34 +2945,76 @@ namespace AConcurrent {
     template <typename Functor>
     inline auto runOnMainThread(Functor func) -> QFuture<typename Private::function_traits<Functor>::result_type> {
         typedef typename Private::function_traits<Functor>::result_type RET;
-        QObject tmp;
         AsyncFuture::Deferred<RET> defer;
         auto worker = [=]() {
             Private::Value<RET> value;
             value.run(func);
             value.complete(defer);
         };
-        QObject::connect(&tmp, &QObject::destroyed, QCoreApplication::instance(), worker, Qt::QueuedConnection);
+        Private::runOnMainThreadVoid(worker);
         return defer.future();
     }
 
     inline QFuture<void> timeout(int value) {
         auto defer = AsyncFuture::deferred<void>();
 
-        QTimer::singleShot(value, [=]() mutable {
+        Private::TimerWheel::instance()->start(value, [=]() mutable {
             defer.complete();
         });
 
         return defer.future();
     }
 
+    /// Returns a future which mirrors the input future. If it is not finished within msec, the input future is canceled, and so is the returned future.
+    /// It must be called on the main thread.
+    template <typename T>
+    QFuture<T> withTimeout(QFuture<T> future, int msec) {
+        auto defer = AsyncFuture::deferred<T>();
+        auto wheel = Private::TimerWheel::instance();
+
+        qint64 id = wheel->start(msec, [=]() mutable {
+            QFuture<T> source = future;
+            source.cancel();
+            // Futures of QtConcurrent::run() ignore cancel()
+            defer.cancel();
+        });
+
+        auto stop = [=]() {
+            wheel->cancel(id);
+        };
+
+        AsyncFuture::observe(future).subscribe(stop, stop);
+        defer.complete(future);
+        return defer.future();
+    }
+
     // Wait for a QFuture to be finished without blocking
+    // On a worker thread of an Executor, it runs the queued functions of the executor (or lets the pool start another thread) instead of nesting an event loop.
     template <typename T>
     inline void await(QFuture<T> future, int timeout = -1) {
         if (future.isFinished()) {
             return;
         }
 
+        // Don't nest an event loop on a worker thread. Help the executor instead.
+        auto isFinished = [=]() {
+            return future.isFinished();
+        };
+        auto subscribe = [=](std::function<void()> callback) {
+            // The finished signal of the future is observed on the main thread, as the worker thread has no event loop
+            QFuture<T> f = future;
+            Private::runOnMainThreadVoid([=]() {
+                AsyncFuture::observe(f).subscribe(callback, callback);
+            });
+        };
+        auto block = [=]() {
+            QFuture<T> f = future;
+            f.waitForFinished();
+        };
+        if (Private::waitOnWorkerThread(isFinished, subscribe, block, timeout)) {
+            return;
+        }
+
         QFutureWatcher<T> watcher;
         watcher.setFuture(future);
         QEventLoop loop;
@@ -388,59 +3028,221 @@ namespace AConcurrent {
         loop.exec();
     }
 
+    // Move the results out of a finished future instead of copying them like QFuture::results().
+    // The future keeps the moved-from values, so it must not be read by anyone else afterward. Pipeline and mapped() don't keep
+    // another copy of the results, so the result store of the future is the only storage to move them from.
+    // It returns an empty vector if the future is not finished, as the results may still be reported and read by the other copies.
+    template <typename T>
+    inline QVector<T> takeResults(QFuture<T> future) {
+        Q_ASSERT(future.isFinished());
+        QVector<T> res;
+        if (!future.isFinished()) {
+            return res;
+        }
+
+        int count = future.resultCount();
+        res.reserve(count);
+        for (int i = 0 ; i < count ; i++) {
+            // resultReference() locks the future. A finished future never reports another result.
+            res.append(std::move(const_cast<T&>(future.d.resultReference(i))));
+        }
+        return res;
+    }
+
+    /// Run functor once the future is finished, unless debounce() is called again with the same context and key before that.
+    /// A newer call cancels the pending one. It could be called from any thread, and functor is always executed on the main thread.
+    /// Pending calls are canceled once the context is destroyed.
     template <typename T, typename Functor>
     void debounce(QObject* context, QString key, QFuture<T> future, Functor functor) {
 
-        QString k = Private::key(context, key);
+        Private::DebounceKey k = Private::key(context, key);
 
         auto defer = AsyncFuture::deferred<void>();
 
-        auto cleanup = [=]() {
-            if (Private::debounceStore.contains(k) &&
-                Private::debounceStore[k] == defer.future()) {
-                Private::debounceStore.remove(k);
-            }
+        // Cancel the previous call. It is no-op on an empty future.
+        Private::debounceStore.replace(k, defer.future()).cancel();
+
+        auto subscribe = [=]() {
+            auto d = defer;
+
+            auto cleanup = [=]() {
+                Private::debounceStore.remove(k, d.future());
+            };
+
+            d.subscribe([=]() {
+                if (Private::debounceStore.isCurrent(k, d.future())) {
+                    functor();
+                }
+                cleanup();
+            }, cleanup);
+
+            d.complete(future);
         };
 
-        defer.subscribe([=]() {
-            if (Private::debounceStore.contains(k) &&
-                Private::debounceStore[k] == defer.future()) {
-                functor();
-            }
-            cleanup();
-        }, cleanup);
+        if (QThread::currentThread() == QCoreApplication::instance()->thread()) {
+            subscribe();
+        } else {
+            Private::runOnMainThreadVoid(subscribe);
+        }
+    }
+
+    /// Run functor on the main thread once debounce() is not called again with the same context and key for msec.
+    /// It could be called from any thread. Pending calls are canceled once the context is destroyed.
+    template <typename Functor>
+    void debounce(QObject* context, QString key, int msec, Functor functor) {
+        Private::TimerWheel::instance()->debounce(Private::key(context, key), msec, functor);
+    }
+
+    /// Run functor on the main thread at most once per msec for the same context and key. The first call runs immediately,
+    /// and the last call made during the period runs at the end of it. It could be called from any thread.
+    template <typename Functor>
+    void throttle(QObject* context, QString key, int msec, Functor functor) {
+        Private::TimerWheel::instance()->throttle(Private::key(context, key), msec, functor);
+    }
+
+    template <typename RET, typename ARG>
+    class Queue {
+    private:
+        class Context {
+        public:
+            Context() : serial(0), current(-1), currentPriority(0), started(false), maxInFlight(0), running(0) {
+            }
+
+            class Item {
+            public:
+                ARG value;
+                int priority;
+                AsyncFuture::Deferred<RET> task;
+                qint64 enqueuedAt;
+            };
+
+            /// Move the items enqueued by any thread to the pending list. It must be called on the main thread.
+            void drain() {
+                Q_ASSERT(QThread::currentThread() == QCoreApplication::instance()->thread());
+                inbox.consume([&](const Item& item) {
+                    items[serial] = item;
+                    pending.enqueue(serial, 1, item.priority);
+                    serial++;
+                });
+            }
+
+            /// Choose the head if it is not chosen yet
+            void choose() {
+                drain();
+                if (current < 0 && pending.size() > 0) {
+                    int size, priority;
+                    pending.take(1, serial, &current, &size, &priority, &currentPriority);
+                }
+            }
+
+            /// Start the pending items until maxInFlight items are running. It must be called on the main thread.
+            static void schedule(QSharedPointer<Context> d) {
+                d->drain();
+                while (d->running < d->maxInFlight && d->pending.size() > 0) {
+                    int index, size, priority, effectivePriority;
+                    d->pending.take(1, d->serial, &index, &size, &priority, &effectivePriority);
+                    Item item = d->items.take(index);
+                    d->waiting.fetchAndAddOrdered(-1);
+                    d->running++;
+
+                    d->start(item, effectivePriority, [=](Private::Value<RET>& result) {
+                        Q_UNUSED(result);
+                        d->running--;
+                        schedule(d);
+                    });
+                }
+            }
+
+            /// Run an item and complete its task. onFinished(Value<RET>& result) is called on the main thread afterward.
+            template <typename Functor>
+            void start(Item item, int priority, Functor onFinished) {
+                auto worker = this->worker;
+                auto collector = this->collector;
+                if (Private::MetricsCollector::Enabled) {
+                    collector->dispatched(1, collector->now() - item.enqueuedAt);
+                }
+
+                executor->start([=]() {
+                    QElapsedTimer timer;
+                    if (Private::MetricsCollector::Enabled) {
+                        timer.start();
+                    }
+                    Private::Value<RET> result;
+                    result.run([&]() {
+                        return worker(item.value);
+                    });
+
+                    qint64 finishedAt = 0;
+                    if (Private::MetricsCollector::Enabled) {
+                        collector->executed(1, timer.nsecsElapsed());
+                        finishedAt = collector->now();
+                    }
+
+                    Private::runOnMainThreadVoid([=]() mutable {
+                        if (Private::MetricsCollector::Enabled) {
+                            collector->finished(1, collector->now() - finishedAt);
+                        }
+                        result.complete(item.task);
+                        onFinished(result);
+                    });
+                }, priority);
+            }
+
+            ExecutorRef executor;
+            std::function<RET(ARG)> worker;
+            AsyncFuture::Deferred<RET> defer;
+
+            /// It is null if metrics are disabled
+            QSharedPointer<Private::MetricsCollector> collector;
+
+            /// Items enqueued but not drained yet. It could be pushed by any thread.
+            Private::MpscQueue<Item> inbox;
+
+            /// no. of items enqueued and not taken yet, including the items of inbox. It could be read by any thread.
+            QAtomicInt waiting;
+
+            /// The queued items keyed by their serial no. It is only accessed by the main thread.
+            QMap<int, Item> items;
 
-        defer.complete(future);
+            /// The serial no. of items in the order of priority
+            Private::PendingQueue pending;
 
-        if (Private::debounceStore.contains(k)) {
-            Private::debounceStore[k].cancel();
-        }
-        Private::debounceStore[k] = defer.future();
-    }
+            int serial;
 
-    template <typename RET, typename ARG>
-    class Queue {
-    private:
-        class Context {
-        public:
-            QPointer<QThreadPool> pool;
-            std::function<RET(ARG)> worker;
-            AsyncFuture::Deferred<RET> defer;
-            QQueue<ARG> queue;
+            /// The serial no. of the head. -1 if it is not chosen yet.
+            int current;
+
+            int currentPriority;
 
             // Is the head started?
             bool started;
+
+            /// The max. no. of running items. 0 if the queue is driven by run() and dequeue().
+            int maxInFlight;
+
+            int running;
         };
 
     public:
-        Queue(QThreadPool* pool, std::function<RET(ARG)> worker) : d(QSharedPointer<Context>::create()) {
-            d->pool = pool;
+        /// Create a queue. If maxInFlight is 0, only the head is run by calling run(), and it is removed by dequeue().
+        /// Otherwise, the queue keeps up to maxInFlight items running and starts the next item once an item is finished.
+        Queue(ExecutorRef executor, std::function<RET(ARG)> worker, int maxInFlight = 0) : d(QSharedPointer<Context>::create()) {
+            d->executor = executor;
             d->worker = worker;
-            d->started = false;
+            d->maxInFlight = qMax(maxInFlight, 0);
+            if (Private::MetricsCollector::Enabled) {
+                d->collector = QSharedPointer<Private::MetricsCollector>::create();
+            }
+        }
+
+        /// Returns a snapshot of the metrics of the queue. It could be called by any thread.
+        Metrics metrics() const {
+            return d->collector ? d->collector->snapshot() : Metrics();
         }
 
+        /// no. of items enqueued and not dequeued (or started with maxInFlight) yet. It could be called by any thread.
         int count() {
-            return d->queue.count();
+            return d->waiting.load();
         }
 
         // The head's future
@@ -448,30 +3250,65 @@ namespace AConcurrent {
             return d->defer.future();
         }
 
-        void enqueue(ARG arg) {
-            d->queue.enqueue(arg);
+        /// Enqueue an item and return its future. It could be called by any thread. The item with the highest priority becomes the head.
+        /// A waiting item gains priority over time, so it is not starved. Once the head is chosen by head() or run(), it is not changed until dequeue().
+        QFuture<RET> enqueue(ARG arg, int priority = 0) {
+            typename Context::Item item;
+            item.value = arg;
+            item.priority = priority;
+            item.enqueuedAt = 0;
+            QFuture<RET> future = item.task.future();
+
+            if (Private::MetricsCollector::Enabled) {
+                item.enqueuedAt = d->collector->now();
+                d->collector->enqueued(1);
+            }
+
+            d->waiting.fetchAndAddOrdered(1);
+            // Only the first item after the inbox is drained needs to wake up the main thread
+            if (d->inbox.push(item) && d->maxInFlight > 0) {
+                auto context = d;
+                Private::runOnMainThreadVoid([=]() {
+                    Context::schedule(context);
+                });
+            }
+            return future;
         }
 
+        /// The head item. head(), dequeue() and run() must be called on the main thread, as they drain the items enqueued by the other threads.
         ARG head() {
-            return d->queue.head();
+            d->choose();
+            return d->items.value(d->current).value;
         }
 
         void dequeue() {
+            bool started = d->started;
             d->defer = AsyncFuture::deferred<RET>();
             d->started = false;
-            if (d->queue.count() > 0) {
-                d->queue.dequeue();
+            d->choose();
+            if (d->current >= 0) {
+                typename Context::Item item = d->items.take(d->current);
+                d->waiting.fetchAndAddOrdered(-1);
+                if (!started) {
+                    item.task.cancel();
+                }
+                d->current = -1;
             }
         }
 
         QFuture<RET> run() {
             // Run the head item
-            if (d->started || d->queue.count() == 0) {
+            d->choose();
+            if (d->started || d->current < 0) {
                 return d->defer.future();
             }
             d->started = true;
-            auto f = QtConcurrent::run(d->pool, d->worker, d->queue.head());
-            d->defer.complete(f);
+            auto defer = d->defer;
+            auto item = d->items.value(d->current);
+
+            d->start(item, d->currentPriority, [=](Private::Value<RET>& result) {
+                result.complete(defer);
+            });
             return d->defer.future();
         }
 
@@ -480,14 +3317,14 @@ namespace AConcurrent {
     };
 
     template <typename Functor>
-    inline auto queue(QThreadPool*pool, Functor func) -> Queue<
+    inline auto queue(ExecutorRef executor, Functor func, int maxInFlight = 0) -> Queue<
         typename Private::function_traits<Functor>::result_type,
-        typename Private::function_traits<Functor>::template arg<0>::type
+        typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type
     >{
-        typedef typename Private::function_traits<Functor>::template arg<0>::type ARG;
+        typedef typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type ARG;
         typedef typename Private::function_traits<Functor>::result_type RET;
 
-        Queue<RET,ARG> queue(pool, func);
+        Queue<RET,ARG> queue(executor, func, maxInFlight);
 
 
         return queue;
@@ -495,86 +3332,644 @@ namespace AConcurrent {
 
     template <typename RET, typename ARG>
     class Pipeline {
-
-        QSharedPointer<Private::PipelineContext<RET, ARG>> d;
+        template <typename, typename> friend class Pipeline;
+
+        /// The first stage takes the items. The last stage reports the results. They are the same object unless then() is used.
+        QSharedPointer<Private::PipelineInput<ARG>> head;
+        QSharedPointer<Private::PipelineOutput<RET>> tail;
+
+        QFuture<RET> post(ARG value, qint64 amount, int priority) {
+            auto res = AsyncFuture::Deferred<RET>();
+            auto input = head;
+            auto output = tail;
+            Private::runOnMainThreadVoid([=]() {
+                AsyncFuture::Deferred<RET> task = res;
+                int source = input->_append(value, amount, priority);
+                if (source < 0) {
+                    task.cancel();
+                    return;
+                }
+                output->_expect(source, task);
+            });
+            return res.future();
+        }
 
     public:
         Pipeline() {
         }
 
-        Pipeline(QThreadPool* pool, std::function<RET(ARG)> worker, QList<ARG> input = QList<ARG>()) : d(Private::PipelineContext<RET, ARG>::create(pool, worker, input)) {
+        /// The worker takes (const ARG&) or (const ARG&, const CancellationToken&). It returns RET, or QFuture<RET> if it is asynchronous.
+        template <typename Functor>
+        Pipeline(ExecutorRef executor, Functor worker, QList<ARG> input = QList<ARG>(), const PipelineOptions& options = PipelineOptions()) {
+            typedef typename Private::function_traits<Functor>::result_type R;
+            auto context = Private::PipelineContext<RET, ARG>::create(executor, Private::adaptWorker<R, ARG>(worker), input, options);
+            head = context;
+            tail = context;
         }
 
-        QFuture<RET> add(ARG value) {
+        /// Add a value. Items with higher priority are dispatched first. A waiting item gains priority over time, so it is not starved.
+        QFuture<RET> add(ARG value, int priority = 0) {
             QFuture<RET> future;
-            if (d) {
-                future = d->add(value);
+            if (head) {
+                qint64 amount = head->costOf(value);
+                head->reserve(amount);
+                future = post(value, amount, priority);
             }
             return future;
         }
 
+        /// Add a list of values. It is cheaper than calling add() per value.
+        QList<QFuture<RET>> add(QList<ARG> values, int priority = 0) {
+            QList<QFuture<RET>> futures;
+            if (!head) {
+                return futures;
+            }
+
+            QList<AsyncFuture::Deferred<RET>> tasks;
+            QList<qint64> amounts;
+            qint64 total = 0;
+            for (int i = 0 ; i < values.size() ; i++) {
+                auto task = AsyncFuture::Deferred<RET>();
+                tasks << task;
+                futures << task.future();
+                amounts << head->costOf(values[i]);
+                total += amounts.last();
+            }
+            head->reserve(total);
+
+            auto input = head;
+            auto output = tail;
+            Private::runOnMainThreadVoid([=]() {
+                QList<AsyncFuture::Deferred<RET>> pending = tasks;
+                int first = input->_append(values, amounts, priority);
+                for (int i = 0 ; i < pending.size() ; i++) {
+                    if (first < 0) {
+                        pending[i].cancel();
+                    } else {
+                        output->_expect(first + i, pending[i]);
+                    }
+                }
+            });
+            return futures;
+        }
+
+        /// The future of the last stage. Canceling it cancels every stage.
         QFuture<RET> future() {
             QFuture<RET> future;
-            if (d) {
-                future = d->future();
+            if (tail) {
+                future = tail->future();
+            }
+            return future;
+        }
+
+        /// Add a value only if the pipeline is not full (See PipelineOptions::setCapacity()). It could be called by any thread.
+        /// The future of the added item is written to the future argument.
+        bool tryAdd(ARG value, QFuture<RET>* future = nullptr, int priority = 0) {
+            if (!head) {
+                return false;
+            }
+
+            qint64 amount = head->costOf(value);
+            if (!head->tryReserve(amount)) {
+                return false;
+            }
+
+            QFuture<RET> res = post(value, amount, priority);
+            if (future) {
+                *future = res;
+            }
+            return true;
+        }
+
+        /// Add a value. If the pipeline is full, it blocks the calling thread until there is space.
+        /// It is designed for producers running on worker threads and must not be called on the main thread.
+        QFuture<RET> blockingAdd(ARG value, int priority = 0) {
+            QFuture<RET> future;
+            if (!head) {
+                return future;
+            }
+
+            if (QThread::currentThread() == QCoreApplication::instance()->thread()) {
+                qWarning() << "Pipeline::blockingAdd() is called on the main thread. It is added without waiting.";
+                return add(value, priority);
+            }
+
+            qint64 amount = head->costOf(value);
+            head->waitReserve(amount);
+            return post(value, amount, priority);
+        }
+
+        /// Returns a future that is finished once the pipeline is not full.
+        QFuture<void> spaceAvailable() {
+            QFuture<void> future;
+            if (head) {
+                future = head->spaceAvailable();
             }
             return future;
         }
 
+        /// Set the function to measure the cost of an item against PipelineOptions::capacity(). Every item costs 1 by default.
+        /// It must be called before any item is added.
+        void setCostFunction(std::function<qint64(const ARG&)> function) {
+            if (head) {
+                head->setCostFunction(function);
+            }
+        }
+
+        /// Returns the index of the input item of a result. With UnorderedResults, results are reported in the order of completion.
+        /// It must be called on the main thread. Returns -1 if the result is not available yet.
+        int sourceIndexAt(int resultIndex) const {
+            return tail ? tail->sourceIndexAt(resultIndex) : -1;
+        }
+
         void close() {
-            if (d) {
-                d->close();
+            if (head) {
+                head->close();
+            }
+        }
+
+        /// Returns a snapshot of the metrics of the last stage. It could be called by any thread.
+        Metrics metrics() const {
+            return tail ? tail->metrics() : Metrics();
+        }
+
+        /// Append a stage which runs func on every result of this pipeline as soon as it is reported.
+        /// At most maxConcurrency items of the new stage run at the same time (0 means the max. thread count of the pool).
+        /// The returned pipeline takes the items of this pipeline and reports the results of the new stage.
+        /// It must be called on the main thread before any result is reported, e.g. right after the pipeline is created.
+        template <typename Functor>
+        auto then(ExecutorRef executor, Functor func, int maxConcurrency = 0) -> Pipeline<typename Private::worker_result<Functor>::type, ARG> {
+            PipelineOptions options;
+            options.setMaxConcurrency(maxConcurrency);
+            return then(executor, func, options);
+        }
+
+        /// Append a stage with options. The stage holds at most PipelineOptions::capacity() unfinished items (2 per running task by default).
+        /// This pipeline stops dispatching its items while the new stage is full.
+        template <typename Functor>
+        auto then(ExecutorRef executor, Functor func, const PipelineOptions& options) -> Pipeline<typename Private::worker_result<Functor>::type, ARG> {
+            typedef typename Private::worker_result<Functor>::type NEXT;
+            typedef typename Private::function_traits<Functor>::result_type R;
+
+            Pipeline<NEXT, ARG> res;
+            if (!tail) {
+                return res;
+            }
+
+            PipelineOptions stageOptions = options;
+            if (stageOptions.capacity() <= 0) {
+                int concurrency = options.maxConcurrency() > 0 ? options.maxConcurrency() :
+                                  Private::worker_result<Functor>::async ? Private::AsyncConcurrency : executor->maxThreadCount();
+                stageOptions.setCapacity(concurrency * 2);
             }
+
+            auto stage = Private::PipelineContext<NEXT, RET>::create(executor, Private::adaptWorker<R, RET>(func), QList<RET>(), stageOptions);
+            tail->_connect(stage);
+
+            res.head = head;
+            res.tail = stage;
+            return res;
         }
 
     };
 
 
     template <typename Functor>
-    inline auto pipeline(QThreadPool*pool, Functor func) -> Pipeline<
-        typename Private::function_traits<Functor>::result_type,
-        typename Private::function_traits<Functor>::template arg<0>::type
+    inline auto pipeline(ExecutorRef executor, Functor func, const PipelineOptions& options = PipelineOptions()) -> Pipeline<
+        typename Private::worker_result<Functor>::type,
+        typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type
     >{
-        typedef typename Private::function_traits<Functor>::template arg<0>::type ARG;
-        typedef typename Private::function_traits<Functor>::result_type RET;
+        typedef typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type ARG;
+        typedef typename Private::worker_result<Functor>::type RET;
 
-        Pipeline<RET,ARG> res(pool, func);
+        Pipeline<RET,ARG> res(executor, func, QList<ARG>(), options);
 
         return res;
     }
 
     template <typename Functor, typename ARG>
-    inline auto pipeline(QThreadPool*pool, Functor func, QList<ARG> input) -> Pipeline<
-        typename Private::function_traits<Functor>::result_type,
-        typename Private::function_traits<Functor>::template arg<0>::type
+    inline auto pipeline(ExecutorRef executor, Functor func, QList<ARG> input, const PipelineOptions& options = PipelineOptions()) -> Pipeline<
+        typename Private::worker_result<Functor>::type,
+        typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type
     >{
-        typedef typename Private::function_traits<Functor>::template arg<0>::type A;
-        typedef typename Private::function_traits<Functor>::result_type RET;
+        typedef typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type A;
+        typedef typename Private::worker_result<Functor>::type RET;
 
-        Pipeline<RET, A> res(pool, func, input);
+        Pipeline<RET, A> res(executor, func, input, options);
 
         return res;
     }
 
+    namespace Private {
+
+        /// Start mapped() by a pipeline. Asynchronous workers always run this way.
+        template <typename RET, typename ARG, typename Sequence, typename Functor>
+        inline QFuture<RET> startMapped(ExecutorRef executor, Sequence input, Functor func, const PipelineOptions& options, std::true_type) {
+            auto handler = pipeline(executor, func, input, options);
+            handler.close();
+
+            return handler.future();
+        }
+
+        /// Start mapped() of a synchronous worker. WorkerDispatch runs it by MappedContext unless an option needs the pipeline.
+        template <typename RET, typename ARG, typename Sequence, typename Functor>
+        inline QFuture<RET> startMapped(ExecutorRef executor, Sequence input, Functor func, const PipelineOptions& options, std::false_type) {
+            if (options.dispatchMode() == PipelineOptions::WorkerDispatch && !options.requiresMainThreadDispatch()) {
+                return MappedContext<RET, ARG>::create(executor, adaptWorker<RET, ARG>(func), input, options);
+            }
+
+            return startMapped<RET, ARG>(executor, input, func, options, std::true_type());
+        }
+
+    }
+
+    /// Calls func once for each item in sequence and reports the results by the returned future. With UnorderedResults, the index
+    /// of the input item of a result is not available, as only the future is returned. Use pipeline() and Pipeline::sourceIndexAt() instead.
     template <typename Sequence, typename Functor>
-    inline auto mapped(QThreadPool*pool, Sequence input, Functor func) -> QFuture<typename Private::function_traits<Functor>::result_type>{
-        auto handler = pipeline(pool, func, input);
-        handler.close();
+    inline auto mapped(ExecutorRef executor, Sequence input, Functor func, const PipelineOptions& options = PipelineOptions()) -> QFuture<typename Private::worker_result<Functor>::type>{
+        typedef typename std::decay<typename Private::function_traits<Functor>::template arg<0>::type>::type ARG;
+        typedef typename Private::worker_result<Functor>::type RET;
+
+        return Private::startMapped<RET, ARG>(executor, input, func, options, std::integral_constant<bool, Private::worker_result<Functor>::async>());
+    }
 
-        return handler.future();
+    /// Calls mapFunc once for each item in sequence and reduces the results by reduceFunc(T& result, R value).
+    /// Partial results are reduced per worker in parallel and then combined by combineFunc(T& result, const T& partial) in a tree.
+    /// The order of reduction is not specified.
+    template <typename Sequence, typename MapFunctor, typename ReduceFunctor, typename CombineFunctor,
+              typename = typename std::enable_if<!std::is_convertible<CombineFunctor, PipelineOptions>::value>::type>
+    inline auto mappedReduced(ExecutorRef executor, Sequence input, MapFunctor mapFunc, ReduceFunctor reduceFunc, CombineFunctor combineFunc,
+                              const PipelineOptions& options = PipelineOptions())
+        -> QFuture<typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type> {
+        typedef typename std::decay<typename Private::function_traits<MapFunctor>::template arg<0>::type>::type ARG;
+        typedef typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type T;
+
+        QList<ARG> sequence = input;
+        auto accumulate = [=](T& result, const ARG& value) mutable {
+            reduceFunc(result, mapFunc(value));
+            return true;
+        };
+
+        auto combine = [=](T& result, const T& partial) mutable {
+            combineFunc(result, partial);
+        };
+
+        return Private::ReduceContext<T, ARG>::create(executor, sequence, options.grainSize(), accumulate, combine);
+    }
+
+    /// Same as above but the partial results are combined by reduceFunc. It requires the reduced type could be passed to reduceFunc as a value.
+    template <typename Sequence, typename MapFunctor, typename ReduceFunctor>
+    inline auto mappedReduced(ExecutorRef executor, Sequence input, MapFunctor mapFunc, ReduceFunctor reduceFunc, const PipelineOptions& options = PipelineOptions())
+        -> QFuture<typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type> {
+        typedef typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type T;
+        typedef typename Private::function_traits<ReduceFunctor>::template arg<1>::type V;
+
+        static_assert(std::is_convertible<const T&, V>::value, "mappedReduced(): The partial results could not be combined by the reduce function. Pass a combine function.");
+
+        auto combine = [=](T& result, const T& partial) mutable {
+            reduceFunc(result, partial);
+        };
+
+        return mappedReduced(executor, input, mapFunc, reduceFunc, combine, options);
+    }
+
+    /// Calls filterFunc once for each item in sequence and returns a future with the accepted items in their original order.
+    /// The accepted items are compacted in parallel and reported as a single batch.
+    template <typename Sequence, typename FilterFunctor>
+    inline auto filtered(ExecutorRef executor, Sequence input, FilterFunctor filterFunc, const PipelineOptions& options = PipelineOptions())
+        -> QFuture<typename std::decay<typename Private::function_traits<FilterFunctor>::template arg<0>::type>::type> {
+        typedef typename std::decay<typename Private::function_traits<FilterFunctor>::template arg<0>::type>::type ARG;
+
+        QList<ARG> sequence = input;
+        auto predicate = [=](const ARG& value) mutable -> bool {
+            return filterFunc(value);
+        };
+
+        return Private::FilterContext<ARG>::create(executor, predicate, sequence, options.grainSize());
+    }
+
+    /// Calls filterFunc once for each item in sequence and reduces the accepted items by reduceFunc(T& result, ARG value).
+    /// The partial results are combined by combineFunc(T& result, const T& partial) in a tree.
+    template <typename Sequence, typename FilterFunctor, typename ReduceFunctor, typename CombineFunctor,
+              typename = typename std::enable_if<!std::is_convertible<CombineFunctor, PipelineOptions>::value>::type>
+    inline auto filteredReduced(ExecutorRef executor, Sequence input, FilterFunctor filterFunc, ReduceFunctor reduceFunc, CombineFunctor combineFunc,
+                                const PipelineOptions& options = PipelineOptions())
+        -> QFuture<typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type> {
+        typedef typename std::decay<typename Private::function_traits<FilterFunctor>::template arg<0>::type>::type ARG;
+        typedef typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type T;
+
+        QList<ARG> sequence = input;
+        auto accumulate = [=](T& result, const ARG& value) mutable {
+            if (!filterFunc(value)) {
+                return false;
+            }
+            reduceFunc(result, value);
+            return true;
+        };
+
+        auto combine = [=](T& result, const T& partial) mutable {
+            combineFunc(result, partial);
+        };
+
+        return Private::ReduceContext<T, ARG>::create(executor, sequence, options.grainSize(), accumulate, combine);
+    }
+
+    /// Same as above but the partial results are combined by reduceFunc.
+    template <typename Sequence, typename FilterFunctor, typename ReduceFunctor>
+    inline auto filteredReduced(ExecutorRef executor, Sequence input, FilterFunctor filterFunc, ReduceFunctor reduceFunc, const PipelineOptions& options = PipelineOptions())
+        -> QFuture<typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type> {
+        typedef typename std::decay<typename Private::function_traits<ReduceFunctor>::template arg<0>::type>::type T;
+        typedef typename Private::function_traits<ReduceFunctor>::template arg<1>::type V;
+
+        static_assert(std::is_convertible<const T&, V>::value, "filteredReduced(): The partial results could not be combined by the reduce function. Pass a combine function.");
+
+        auto combine = [=](T& result, const T& partial) mutable {
+            reduceFunc(result, partial);
+        };
+
+        return filteredReduced(executor, input, filterFunc, reduceFunc, combine, options);
     }
 
     template <typename Sequence, typename Functor>
-    inline auto mapped(Sequence input, Functor func) -> QFuture<typename Private::function_traits<Functor>::result_type>{
+    inline auto mapped(Sequence input, Functor func) -> QFuture<typename Private::worker_result<Functor>::type>{
         return mapped(QThreadPool::globalInstance(), input, func);
     }
 
     template <typename Sequence, typename Functor>
-    inline auto blockingMapped(QThreadPool*pool, Sequence input, Functor func) -> QList<typename Private::function_traits<Functor>::result_type>{
-        auto f = mapped(pool, input, func);
+    inline auto blockingMapped(ExecutorRef executor, Sequence input, Functor func, const PipelineOptions& options = PipelineOptions()) -> QList<typename Private::worker_result<Functor>::type>{
+        auto f = mapped(executor, input, func, options);
         await(f);
         return f.results();
     }
 
 }
 
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define ACONCURRENT_HAS_COROUTINES
+#endif
+#endif
+
+#ifdef ACONCURRENT_HAS_COROUTINES
+#include <coroutine>
+
+namespace AConcurrent {
+
+    template <typename T = void>
+    class Task;
+
+    namespace Private {
+
+        template <typename T>
+        class ResultsOf {
+        public:
+            QFuture<T> future;
+        };
+
+        class ResumeOn {
+        public:
+            bool mainThread;
+            ExecutorRef executor;
+        };
+
+        class TaskPromiseBase;
+
+        // FutureAwaiter suspends the coroutine until the future is finished. The future is observed on the main thread,
+        // and the coroutine is resumed by a posted function, so it never nests an event loop.
+        // If the future is canceled, the coroutine is not resumed. The task is canceled and the coroutine is destroyed.
+        template <typename T>
+        class FutureAwaiter {
+        public:
+            FutureAwaiter(QFuture<T> future, TaskPromiseBase* promise) : future(future), promise(promise) {
+            }
+
+            bool await_ready() const {
+                // A canceled future is handled by await_suspend()
+                return future.isFinished() && !future.isCanceled();
+            }
+
+            void await_suspend(std::coroutine_handle<> handle);
+
+        protected:
+            QFuture<T> future;
+            TaskPromiseBase* promise;
+        };
+
+        // co_await QFuture<T> returns the first result. It is a default value if the future is finished without any result.
+        template <typename T>
+        class ResultAwaiter : public FutureAwaiter<T> {
+        public:
+            using FutureAwaiter<T>::FutureAwaiter;
+
+            T await_resume() const {
+                if (this->future.resultCount() == 0) {
+                    return T();
+                }
+                return this->future.result();
+            }
+        };
+
+        template <>
+        class ResultAwaiter<void> : public FutureAwaiter<void> {
+        public:
+            using FutureAwaiter<void>::FutureAwaiter;
+
+            void await_resume() const {
+            }
+        };
+
+        // co_await results(future) returns all the results
+        template <typename T>
+        class ResultsAwaiter : public FutureAwaiter<T> {
+        public:
+            using FutureAwaiter<T>::FutureAwaiter;
+
+            QList<T> await_resume() const {
+                return this->future.results();
+            }
+        };
+
+        // The common part of the promise of Task. It decides where the coroutine is resumed after co_await.
+        class TaskPromiseBase {
+        public:
+            TaskPromiseBase() : mainThread(true) {
+            }
+
+            virtual ~TaskPromiseBase() {
+            }
+
+            /// Cancel the future of the task
+            virtual void cancel() = 0;
+
+            /// Resume the coroutine on the main thread or the executor
+            void schedule(std::coroutine_handle<> handle) {
+                if (mainThread) {
+                    runOnMainThreadVoid([=]() {
+                        handle.resume();
+                    });
+                } else {
+                    executor->start([=]() {
+                        handle.resume();
+                    });
+                }
+            }
+
+            std::suspend_never initial_suspend() noexcept {
+                return {};
+            }
+
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+
+            template <typename R>
+            ResultAwaiter<R> await_transform(QFuture<R> future) {
+                return ResultAwaiter<R>(future, this);
+            }
+
+            template <typename R>
+            ResultAwaiter<R> await_transform(Task<R> task) {
+                return ResultAwaiter<R>(task.future(), this);
+            }
+
+            template <typename R>
+            ResultsAwaiter<R> await_transform(ResultsOf<R> results) {
+                return ResultsAwaiter<R>(results.future, this);
+            }
+
+            auto await_transform(ResumeOn target) {
+                class SwitchAwaiter {
+                public:
+                    bool await_ready() const {
+                        return false;
+                    }
+
+                    void await_suspend(std::coroutine_handle<> handle) {
+                        promise->mainThread = target.mainThread;
+                        promise->executor = target.executor;
+                        promise->schedule(handle);
+                    }
+
+                    void await_resume() const {
+                    }
+
+                    TaskPromiseBase* promise;
+                    ResumeOn target;
+                };
+
+                return SwitchAwaiter{this, target};
+            }
+
+            bool mainThread;
+            ExecutorRef executor;
+        };
+
+        template <typename T>
+        void FutureAwaiter<T>::await_suspend(std::coroutine_handle<> handle) {
+            auto future = this->future;
+            auto promise = this->promise;
+
+            auto watch = [=]() {
+                auto resume = [=]() {
+                    promise->schedule(handle);
+                };
+                auto cancel = [=]() {
+                    // The task shares the fate of the awaited future. The coroutine is suspended, so it could be destroyed here.
+                    promise->cancel();
+                    handle.destroy();
+                };
+                AsyncFuture::observe(future).subscribe(resume, cancel);
+            };
+
+            if (QThread::currentThread() == QCoreApplication::instance()->thread()) {
+                watch();
+            } else {
+                runOnMainThreadVoid(watch);
+            }
+        }
+
+        template <typename T>
+        class TaskPromise : public TaskPromiseBase {
+        public:
+            Task<T> get_return_object() {
+                return Task<T>(defer.future());
+            }
+
+            void unhandled_exception() {
+                defer.cancel();
+            }
+
+            void cancel() override {
+                defer.cancel();
+            }
+
+            void return_value(T value) {
+                defer.complete(value);
+            }
+
+            AsyncFuture::Deferred<T> defer;
+        };
+
+        template <>
+        class TaskPromise<void> : public TaskPromiseBase {
+        public:
+            Task<void> get_return_object();
+
+            void unhandled_exception() {
+                defer.cancel();
+            }
+
+            void cancel() override {
+                defer.cancel();
+            }
+
+            void return_void() {
+                defer.complete();
+            }
+
+            AsyncFuture::Deferred<void> defer;
+        };
+    }
+
+    /// Task is the return type of a coroutine. The coroutine starts immediately on the calling thread, and it is resumed on the main thread
+    /// after co_await unless resumeOn() is awaited. It could co_await QFuture<T> (including timeout(), runOnMainThread() and mapped()),
+    /// results() and other tasks. The result of the coroutine is reported to future().
+    template <typename T>
+    class Task {
+    public:
+        typedef Private::TaskPromise<T> promise_type;
+
+        Task(QFuture<T> future) : m_future(future) {
+        }
+
+        QFuture<T> future() const {
+            return m_future;
+        }
+
+    private:
+        QFuture<T> m_future;
+    };
+
+    inline Task<void> Private::TaskPromise<void>::get_return_object() {
+        return Task<void>(defer.future());
+    }
+
+    /// co_await results(future) returns all the results of the future. e.g. the results of mapped()
+    template <typename T>
+    inline Private::ResultsOf<T> results(QFuture<T> future) {
+        return Private::ResultsOf<T>{future};
+    }
+
+    /// co_await resumeOn(executor) moves the rest of the coroutine to a thread of the executor, including the code after the later co_await.
+    inline Private::ResumeOn resumeOn(ExecutorRef executor) {
+        return Private::ResumeOn{false, executor};
+    }
+
+    /// co_await resumeOnMainThread() moves the rest of the coroutine back to the main thread
+    inline Private::ResumeOn resumeOnMainThread() {
+        return Private::ResumeOn{true, ExecutorRef()};
+    }
+}
+
+#endif
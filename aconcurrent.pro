@@ -3,3 +3,4 @@ TEMPLATE = subdirs
 CONFIG += ordered
 
 SUBDIRS += tests/aconcurrentunittests
+SUBDIRS += tests/aconcurrentbenchmarks
@@ -0,0 +1,385 @@
+#include <QtTest>
+#include <QtConcurrent>
+#include <aconcurrent.h>
+#include "aconcurrentbenchmarks.h"
+
+namespace {
+
+    // Combinations taking more than 2 seconds of work per thread are skipped
+    const qint64 MaxWorkload = Q_INT64_C(2000000000);
+
+    // Busy loop for cost nsec
+    int spin(int value, int cost) {
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.nsecsElapsed() < cost) {
+        }
+        return value;
+    }
+
+    // QtConcurrent::mapped() of Qt 5 takes a functor with result_type only
+    class Spin {
+    public:
+        typedef int result_type;
+
+        Spin(int cost) : cost(cost) {
+        }
+
+        int operator()(int value) const {
+            return spin(value, cost);
+        }
+
+        int cost;
+    };
+
+    QList<int> sequence(int count) {
+        QList<int> res;
+        res.reserve(count);
+        for (int i = 0 ; i < count ; i++) {
+            res << i;
+        }
+        return res;
+    }
+
+    QList<int> itemCounts() {
+        return QList<int>() << 10 << 1000 << 100000 << 1000000;
+    }
+
+    /// 1, 2, 4 ... up to the no. of cores
+    QList<int> threadCounts() {
+        QList<int> res;
+        int cores = QThread::idealThreadCount();
+        for (int i = 1 ; i < cores ; i *= 2) {
+            res << i;
+        }
+        res << qMax(cores, 1);
+        return res;
+    }
+
+    void addWorkloads() {
+        QTest::addColumn<int>("count");
+        QTest::addColumn<int>("cost");
+        QTest::addColumn<int>("threads");
+
+        QList<int> costs = QList<int>() << 100 << 10000 << 1000000 << 10000000;
+
+        foreach (int count, itemCounts()) {
+            foreach (int cost, costs) {
+                foreach (int threads, threadCounts()) {
+                    if ((qint64) count * cost / threads > MaxWorkload) {
+                        continue;
+                    }
+                    QString name = QString("items=%1 cost=%2ns threads=%3").arg(count).arg(cost).arg(threads);
+                    QTest::newRow(qPrintable(name)) << count << cost << threads;
+                }
+            }
+        }
+    }
+
+    void addCounts() {
+        QTest::addColumn<int>("count");
+
+        foreach (int count, itemCounts()) {
+            QString name = QString("items=%1").arg(count);
+            QTest::newRow(qPrintable(name)) << count;
+        }
+    }
+
+    void waitUntil(std::function<bool()> condition) {
+        while (!condition()) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+    }
+}
+
+AConcurrentBenchmarks::AConcurrentBenchmarks(QObject *parent) : QObject(parent), defaultThreadCount(0)
+{
+}
+
+void AConcurrentBenchmarks::initTestCase()
+{
+    defaultThreadCount = QThreadPool::globalInstance()->maxThreadCount();
+}
+
+void AConcurrentBenchmarks::cleanupTestCase()
+{
+    QThreadPool::globalInstance()->setMaxThreadCount(defaultThreadCount);
+}
+
+void AConcurrentBenchmarks::mapped_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::mapped()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+    QList<int> input = sequence(count);
+
+    QBENCHMARK {
+        auto future = AConcurrent::mapped(QThreadPool::globalInstance(), input, [=](int value) {
+            return spin(value, cost);
+        });
+        AConcurrent::await(future);
+    }
+}
+
+void AConcurrentBenchmarks::qtConcurrent_mapped_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::qtConcurrent_mapped()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+    QList<int> input = sequence(count);
+
+    QBENCHMARK {
+        QFuture<int> future = QtConcurrent::mapped(input, Spin(cost));
+        future.waitForFinished();
+    }
+}
+
+void AConcurrentBenchmarks::blockingMapped_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::blockingMapped()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+    QList<int> input = sequence(count);
+
+    QBENCHMARK {
+        QList<int> result = AConcurrent::blockingMapped(QThreadPool::globalInstance(), input, [=](int value) {
+            return spin(value, cost);
+        });
+        QCOMPARE(result.size(), count);
+    }
+}
+
+void AConcurrentBenchmarks::qtConcurrent_blockingMapped_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::qtConcurrent_blockingMapped()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+    QList<int> input = sequence(count);
+
+    QBENCHMARK {
+        QList<int> result = QtConcurrent::blockingMapped(input, Spin(cost));
+        QCOMPARE(result.size(), count);
+    }
+}
+
+void AConcurrentBenchmarks::pipeline_add_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::pipeline_add()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+    QList<int> input = sequence(count);
+
+    QBENCHMARK {
+        auto pipeline = AConcurrent::pipeline(QThreadPool::globalInstance(), [=](int value) {
+            return spin(value, cost);
+        });
+        pipeline.add(input);
+        pipeline.close();
+        AConcurrent::await(pipeline.future());
+    }
+}
+
+void AConcurrentBenchmarks::qtConcurrent_run_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::qtConcurrent_run()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+    QBENCHMARK {
+        QList<QFuture<int>> futures;
+        futures.reserve(count);
+        for (int i = 0 ; i < count ; i++) {
+            futures << QtConcurrent::run(spin, i, cost);
+        }
+        for (int i = 0 ; i < futures.size() ; i++) {
+            futures[i].waitForFinished();
+        }
+    }
+}
+
+void AConcurrentBenchmarks::queue_data()
+{
+    addWorkloads();
+}
+
+void AConcurrentBenchmarks::queue()
+{
+    QFETCH(int, count);
+    QFETCH(int, cost);
+    QFETCH(int, threads);
+
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+    QBENCHMARK {
+        auto queue = AConcurrent::queue(QThreadPool::globalInstance(), [=](int value) {
+            return spin(value, cost);
+        }, threads);
+
+        QList<QFuture<int>> futures;
+        futures.reserve(count);
+        for (int i = 0 ; i < count ; i++) {
+            futures << queue.enqueue(i);
+        }
+        for (int i = 0 ; i < futures.size() ; i++) {
+            AConcurrent::await(futures[i]);
+        }
+    }
+}
+
+void AConcurrentBenchmarks::runOnMainThread_data()
+{
+    addCounts();
+}
+
+void AConcurrentBenchmarks::runOnMainThread()
+{
+    QFETCH(int, count);
+
+    QBENCHMARK {
+        int calls = 0;
+        QFuture<void> last;
+        for (int i = 0 ; i < count ; i++) {
+            last = AConcurrent::runOnMainThread([&]() {
+                calls++;
+            });
+        }
+        AConcurrent::await(last);
+        QCOMPARE(calls, count);
+    }
+}
+
+void AConcurrentBenchmarks::qTimer_singleShot_data()
+{
+    addCounts();
+}
+
+void AConcurrentBenchmarks::qTimer_singleShot()
+{
+    QFETCH(int, count);
+
+    QBENCHMARK {
+        int calls = 0;
+        for (int i = 0 ; i < count ; i++) {
+            QTimer::singleShot(0, [&]() {
+                calls++;
+            });
+        }
+        waitUntil([&]() {
+            return calls == count;
+        });
+    }
+}
+
+void AConcurrentBenchmarks::debounce_data()
+{
+    addCounts();
+}
+
+void AConcurrentBenchmarks::debounce()
+{
+    QFETCH(int, count);
+
+    QBENCHMARK {
+        int calls = 0;
+        auto defer = AsyncFuture::deferred<void>();
+        for (int i = 0 ; i < count ; i++) {
+            AConcurrent::debounce(this, "benchmark", defer.future(), [&]() {
+                calls++;
+            });
+        }
+        defer.complete();
+        waitUntil([&]() {
+            return calls > 0;
+        });
+    }
+}
+
+void AConcurrentBenchmarks::debounce_msec_data()
+{
+    addCounts();
+}
+
+void AConcurrentBenchmarks::debounce_msec()
+{
+    QFETCH(int, count);
+
+    QBENCHMARK {
+        int calls = 0;
+        for (int i = 0 ; i < count ; i++) {
+            AConcurrent::debounce(this, "benchmark", 1, [&]() {
+                calls++;
+            });
+        }
+        waitUntil([&]() {
+            return calls > 0;
+        });
+    }
+}
+
+void AConcurrentBenchmarks::qTimer_restart_data()
+{
+    addCounts();
+}
+
+void AConcurrentBenchmarks::qTimer_restart()
+{
+    QFETCH(int, count);
+
+    QBENCHMARK {
+        int calls = 0;
+        QTimer timer;
+        timer.setSingleShot(true);
+        connect(&timer, &QTimer::timeout, [&]() {
+            calls++;
+        });
+
+        for (int i = 0 ; i < count ; i++) {
+            timer.start(1);
+        }
+        waitUntil([&]() {
+            return calls > 0;
+        });
+    }
+}
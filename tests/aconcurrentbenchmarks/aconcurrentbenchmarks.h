@@ -0,0 +1,67 @@
+#pragma once
+#include <QObject>
+
+class AConcurrentBenchmarks : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AConcurrentBenchmarks(QObject *parent = 0);
+
+private slots:
+
+    void initTestCase();
+
+    void cleanupTestCase();
+
+    void mapped_data();
+
+    void mapped();
+
+    void qtConcurrent_mapped_data();
+
+    void qtConcurrent_mapped();
+
+    void blockingMapped_data();
+
+    void blockingMapped();
+
+    void qtConcurrent_blockingMapped_data();
+
+    void qtConcurrent_blockingMapped();
+
+    void pipeline_add_data();
+
+    void pipeline_add();
+
+    void qtConcurrent_run_data();
+
+    void qtConcurrent_run();
+
+    void queue_data();
+
+    void queue();
+
+    void runOnMainThread_data();
+
+    void runOnMainThread();
+
+    void qTimer_singleShot_data();
+
+    void qTimer_singleShot();
+
+    void debounce_data();
+
+    void debounce();
+
+    void debounce_msec_data();
+
+    void debounce_msec();
+
+    void qTimer_restart_data();
+
+    void qTimer_restart();
+
+private:
+
+    int defaultThreadCount;
+};
@@ -0,0 +1,20 @@
+QT       += testlib concurrent
+
+TARGET = aconcurrentbenchmarks
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += main.cpp \
+    aconcurrentbenchmarks.cpp
+
+ROOTDIR = $$PWD/../../
+
+include(vendor/vendor.pri)
+include($$ROOTDIR/aconcurrent.pri)
+
+DISTFILES += qpm.json
+
+HEADERS += \
+    aconcurrentbenchmarks.h
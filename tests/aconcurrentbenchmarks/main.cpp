@@ -0,0 +1,12 @@
+#include <QtTest>
+#include "aconcurrentbenchmarks.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    AConcurrentBenchmarks benchmarks;
+
+    // Results are machine-readable by the standard options of QtTest. e.g. -o result.csv,csv or -o result.xml,xml
+    return QTest::qExec(&benchmarks, argc, argv);
+}
@@ -244,6 +244,118 @@ void AConcurrentTests::test_mapped_progress()
 
 }
 
+void AConcurrentTests::test_mapped_chunked()
+{
+    auto worker = [](int value) {
+        return value * value;
+    };
+
+    int count = 10000;
+    QList<int> input;
+    QList<int> expected;
+
+    for (int i = 0 ; i < count ; i++) {
+        input << (i+1);
+        expected << (i+1) * (i+1);
+    }
+
+    {
+        // Fixed grain size
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setGrainSize(64));
+        QCOMPARE(future.progressMaximum(), count);
+        AConcurrent::await(future);
+
+        QCOMPARE(future.progressValue(), count);
+        QCOMPARE(future.resultCount(), count);
+        QVERIFY(future.results() == expected);
+    }
+
+    {
+        // Adaptive grain size
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setGrainSize(PipelineOptions::AdaptiveGrainSize));
+        AConcurrent::await(future);
+
+        QCOMPARE(future.progressValue(), count);
+        QCOMPARE(future.resultCount(), count);
+        QVERIFY(future.results() == expected);
+    }
+
+    {
+        // Items added later are executed in chunks too
+        auto pipeline = AConcurrent::pipeline(&pool, worker, input.mid(0, 10), PipelineOptions().setGrainSize(4));
+        auto future = pipeline.add(11);
+        pipeline.close();
+
+        AConcurrent::await(pipeline.future());
+        QCOMPARE(future.result(), 121);
+        QCOMPARE(pipeline.future().resultCount(), 11);
+        QVERIFY(pipeline.future().results() == expected.mid(0, 11));
+    }
+}
+
+void AConcurrentTests::test_mapped_worker_dispatch()
+{
+    auto worker = [](int value) {
+        QThread::msleep(1);
+        return value * value;
+    };
+
+    int count = 100;
+    QList<int> input;
+    QList<int> expected;
+
+    for (int i = 0 ; i < count ; i++) {
+        input << (i+1);
+        expected << (i+1) * (i+1);
+    }
+
+    auto options = PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch);
+
+    {
+        QSemaphore processed(0);
+        auto counting = [&](int value) {
+            int res = worker(value);
+            processed.release();
+            return res;
+        };
+
+        QFuture<int> future = AConcurrent::mapped(&pool, input, counting, options);
+        QCOMPARE(future.progressMaximum(), count);
+
+        // Workers keep running even the main thread is busy. It blocks without running the event loop.
+        QVERIFY(processed.tryAcquire(count, 5000));
+
+        AConcurrent::await(future);
+        QCOMPARE(future.resultCount(), count);
+        QCOMPARE(future.isFinished(), true);
+        QCOMPARE(future.progressValue(), count);
+        QVERIFY(future.results() == expected);
+    }
+
+    {
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, options.setGrainSize(PipelineOptions::AdaptiveGrainSize));
+        AConcurrent::await(future);
+        QVERIFY(future.results() == expected);
+    }
+
+    {
+        QFuture<int> future = AConcurrent::mapped(&pool, QList<int>(), worker, options);
+        AConcurrent::await(future);
+        QCOMPARE(future.isFinished(), true);
+        QCOMPARE(future.resultCount(), 0);
+    }
+
+    {
+        // Cancel
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, options.setGrainSize(1));
+        Automator::wait(10);
+        future.cancel();
+        Automator::wait(200);
+        QCOMPARE(future.isCanceled(), true);
+        QVERIFY(future.resultCount() < count);
+    }
+}
+
 void AConcurrentTests::test_blockingMapped()
 {
     auto worker = [](int value) {
@@ -260,6 +372,136 @@ void AConcurrentTests::test_blockingMapped()
     QVERIFY(result == expected);
 }
 
+void AConcurrentTests::test_mappedReduced()
+{
+    QList<int> input;
+    qint64 expected = 0;
+    for (int i = 0 ; i < 100000 ; i++) {
+        input << i;
+        expected += i * 2;
+    }
+
+    auto map = [](int value) -> qint64 {
+        return value * 2;
+    };
+
+    auto sum = [](qint64& result, qint64 value) {
+        result += value;
+    };
+
+    {
+        QFuture<qint64> future = AConcurrent::mappedReduced(&pool, input, map, sum);
+        AConcurrent::await(future);
+        QCOMPARE(future.isFinished(), true);
+        QCOMPARE(future.progressValue(), input.size());
+        QCOMPARE(future.result(), expected);
+    }
+
+    {
+        auto options = PipelineOptions().setGrainSize(PipelineOptions::AdaptiveGrainSize);
+        QFuture<qint64> future = AConcurrent::mappedReduced(&pool, input, map, sum, options);
+        AConcurrent::await(future);
+        QCOMPARE(future.result(), expected);
+    }
+
+    {
+        // Reduce into a different type with a combine function
+        auto mod = [](int value) {
+            return value % 10;
+        };
+
+        auto count = [](QMap<int,int>& result, int value) {
+            result[value]++;
+        };
+
+        auto combine = [](QMap<int,int>& result, const QMap<int,int>& partial) {
+            for (auto iter = partial.begin() ; iter != partial.end() ; iter++) {
+                result[iter.key()] += iter.value();
+            }
+        };
+
+        QFuture<QMap<int,int>> future = AConcurrent::mappedReduced(&pool, input, mod, count, combine);
+        AConcurrent::await(future);
+        QMap<int,int> result = future.result();
+        QCOMPARE(result.size(), 10);
+        for (int i = 0 ; i < 10 ; i++) {
+            QCOMPARE(result[i], 10000);
+        }
+    }
+
+    {
+        QFuture<qint64> future = AConcurrent::mappedReduced(&pool, QList<int>(), map, sum);
+        AConcurrent::await(future);
+        QCOMPARE(future.result(), (qint64) 0);
+    }
+}
+
+void AConcurrentTests::test_filtered()
+{
+    QList<int> input;
+    QList<int> expected;
+    int sum = 0;
+    for (int i = 0 ; i < 10000 ; i++) {
+        input << i;
+        if (i % 3 == 0) {
+            expected << i;
+            sum += i;
+        }
+    }
+
+    auto predicate = [](int value) {
+        return value % 3 == 0;
+    };
+
+    {
+        QFuture<int> future = AConcurrent::filtered(&pool, input, predicate);
+        AConcurrent::await(future);
+        QCOMPARE(future.isFinished(), true);
+        QCOMPARE(future.progressValue(), input.size());
+        QCOMPARE(future.resultCount(), expected.size());
+        QVERIFY(future.results() == expected);
+    }
+
+    {
+        auto options = PipelineOptions().setGrainSize(PipelineOptions::AdaptiveGrainSize);
+        QFuture<int> future = AConcurrent::filtered(&pool, input, predicate, options);
+        AConcurrent::await(future);
+        QVERIFY(future.results() == expected);
+    }
+
+    {
+        QFuture<int> future = AConcurrent::filtered(&pool, QList<int>(), predicate);
+        AConcurrent::await(future);
+        QCOMPARE(future.isFinished(), true);
+        QCOMPARE(future.resultCount(), 0);
+    }
+
+    {
+        auto reduce = [](int& result, int value) {
+            result += value;
+        };
+
+        QFuture<int> future = AConcurrent::filteredReduced(&pool, input, predicate, reduce);
+        AConcurrent::await(future);
+        QCOMPARE(future.result(), sum);
+    }
+
+    {
+        // Cancel
+        auto slow = [](int value) {
+            QThread::msleep(1);
+            return value % 3 == 0;
+        };
+
+        QFuture<int> future = AConcurrent::filtered(&pool, input, slow);
+        Automator::wait(10);
+        future.cancel();
+        Automator::wait(100);
+        QCOMPARE(future.isCanceled(), true);
+        QCOMPARE(future.resultCount(), 0);
+    }
+}
+
 void AConcurrentTests::test_queue()
 {
     int count = 0;
@@ -357,14 +599,100 @@ void AConcurrentTests::test_runOnMainThread()
 
 }
 
+void AConcurrentTests::test_runOnMainThread_order()
+{
+    // Functions posted by the same thread are executed in order
+    int count = 5000;
+    QList<int> results[4];
+
+    auto producer = [&](int id) {
+        for (int i = 0 ; i < count ; i++) {
+            AConcurrent::Private::runOnMainThreadVoid([&results, id, i]() {
+                results[id] << i;
+            });
+        }
+    };
+
+    QList<QFuture<void>> futures;
+    for (int i = 0 ; i < 4 ; i++) {
+        futures << QtConcurrent::run(&pool, producer, i);
+    }
+
+    for (int i = 0 ; i < 4 ; i++) {
+        await(futures[i]);
+    }
+
+    QVERIFY(waitUntil([&]() {
+        return results[0].size() == count && results[1].size() == count &&
+               results[2].size() == count && results[3].size() == count;
+    }, 5000));
+
+    for (int id = 0 ; id < 4 ; id++) {
+        for (int i = 0 ; i < count ; i++) {
+            QCOMPARE(results[id][i], i);
+        }
+    }
+}
+
+void AConcurrentTests::test_runOnMainThread_nested()
+{
+    {
+        // A function nesting an event loop doesn't hold back the functions posted after it
+        auto defer = AsyncFuture::deferred<void>();
+        QList<int> order;
+        bool finished = false;
+
+        AConcurrent::Private::runOnMainThreadVoid([&]() {
+            order << 0;
+            AConcurrent::await(defer.future(), 3000);
+            finished = defer.future().isFinished();
+            order << 3;
+        });
+        AConcurrent::Private::runOnMainThreadVoid([&]() {
+            order << 1;
+        });
+        AConcurrent::Private::runOnMainThreadVoid([&]() mutable {
+            order << 2;
+            defer.complete();
+        });
+
+        QVERIFY(waitUntil([&]() {
+            return order.size() == 4;
+        }, 5000));
+        QCOMPARE(finished, true);
+        QCOMPARE(order, QList<int>() << 0 << 1 << 2 << 3);
+    }
+
+    {
+        // Await a pipeline closed by a function posted later
+        QList<int> input = QList<int>() << 1 << 2 << 3;
+        auto pipeline = AConcurrent::pipeline(&pool, [](int value) {
+            return value * 2;
+        }, input);
+
+        QFuture<int> future = pipeline.future();
+        bool finished = false;
+        AConcurrent::Private::runOnMainThreadVoid([&]() {
+            AConcurrent::await(future, 3000);
+            finished = future.isFinished();
+        });
+        pipeline.close();
+
+        QVERIFY(waitUntil([&]() {
+            return finished;
+        }, 5000));
+        QCOMPARE(future.resultCount(), 3);
+    }
+}
+
 void AConcurrentTests::test_debounce()
 {
     {
-        QString k1 = AConcurrent::Private::key(this, "key1");
-        QString k2 = AConcurrent::Private::key(this, "key2");
+        AConcurrent::Private::DebounceKey k1 = AConcurrent::Private::key(this, "key1");
+        AConcurrent::Private::DebounceKey k2 = AConcurrent::Private::key(this, "key2");
 
         QVERIFY(k1 != k2);
-        qDebug() << k1 << k2;
+        QVERIFY(k1 == AConcurrent::Private::key(this, "key1"));
 
     }
 
@@ -437,6 +765,123 @@ void AConcurrentTests::test_debounce()
 
 }
 
+void AConcurrentTests::test_debounce_context()
+{
+    int count = 0;
+
+    {
+        // Destroying the context cancels the pending call
+        QObject* context = new QObject();
+        auto defer = AsyncFuture::deferred<void>();
+        AConcurrent::debounce(context, "destroy", defer.future(), [&]() {
+            count++;
+        });
+        QCOMPARE(AConcurrent::Private::debounceStore.size(), 1);
+
+        delete context;
+        QCOMPARE(AConcurrent::Private::debounceStore.size(), 0);
+
+        defer.complete();
+        Automator::wait(50);
+        QCOMPARE(count, 0);
+    }
+
+    {
+        // Call from worker threads. Only the last call is executed, on the main thread.
+        QThread* mainThread = QThread::currentThread();
+        QThread* executedThread = nullptr;
+        auto defer = AsyncFuture::deferred<void>();
+
+        auto f = QtConcurrent::run([&]() {
+            for (int i = 0 ; i < 100 ; i++) {
+                AConcurrent::debounce(this, "thread", defer.future(), [&]() {
+                    count++;
+                    executedThread = QThread::currentThread();
+                });
+            }
+        });
+        await(f);
+        QCOMPARE(AConcurrent::Private::debounceStore.size(), 1);
+
+        defer.complete();
+        Automator::wait(50);
+        QCOMPARE(count, 1);
+        QVERIFY(executedThread == mainThread);
+        QCOMPARE(AConcurrent::Private::debounceStore.size(), 0);
+    }
+}
+
+void AConcurrentTests::test_timerWheel()
+{
+    {
+        // Timers are fired in order of deadline
+        QList<int> seq;
+        auto f1 = AConcurrent::timeout(100);
+        auto f2 = AConcurrent::timeout(10);
+        AsyncFuture::observe(f1).subscribe([&]() { seq << 1; });
+        AsyncFuture::observe(f2).subscribe([&]() { seq << 2; });
+
+        await(f1);
+        QCOMPARE(seq, QList<int>() << 2 << 1);
+        QCOMPARE(AConcurrent::Private::TimerWheel::instance()->size(), 0);
+    }
+
+    {
+        // withTimeout() cancels a slow future
+        auto slow = AsyncFuture::deferred<int>();
+        auto future = AConcurrent::withTimeout(slow.future(), 50);
+        await(future, 1000);
+        QVERIFY(future.isCanceled());
+        QVERIFY(slow.future().isCanceled());
+
+        auto fast = AsyncFuture::deferred<int>();
+        future = AConcurrent::withTimeout(fast.future(), 1000);
+        fast.complete(3);
+        await(future);
+        QVERIFY(!future.isCanceled());
+        QCOMPARE(future.result(), 3);
+        Automator::wait(10);
+        QCOMPARE(AConcurrent::Private::TimerWheel::instance()->size(), 0);
+    }
+
+    {
+        // Only the last call of debounce() is executed
+        QList<int> seq;
+        for (int i = 0 ; i < 10; i++) {
+            AConcurrent::debounce(this, "wheel", 50, [&seq, i]() {
+                seq << i;
+            });
+        }
+        QCOMPARE(seq.size(), 0);
+        Automator::wait(200);
+        QCOMPARE(seq, QList<int>() << 9);
+    }
+
+    {
+        // throttle() runs the first call immediately and the last one at the end of the period
+        QList<int> seq;
+        for (int i = 0 ; i < 10; i++) {
+            AConcurrent::throttle(this, "wheel", 50, [&seq, i]() {
+                seq << i;
+            });
+        }
+        QCOMPARE(seq, QList<int>() << 0);
+        Automator::wait(200);
+        QCOMPARE(seq, QList<int>() << 0 << 9);
+    }
+
+    {
+        // A timer in a higher level is fired on time after it is cascaded down
+        QElapsedTimer timer;
+        timer.start();
+        auto future = AConcurrent::timeout(300);
+        await(future, 2000);
+        QVERIFY(future.isFinished());
+        QVERIFY(timer.elapsed() >= 290);
+        QVERIFY(timer.elapsed() < 1000);
+    }
+}
+
 void AConcurrentTests::test_pipeline()
 {
     auto worker = [&](int value) -> qreal {
@@ -792,3 +1237,1046 @@ void AConcurrentTests::test_pipeline_dynamic_add()
 
 }
 
+
+
+void AConcurrentTests::test_pipeline_add_list()
+{
+    auto worker = [](int value) {
+        return value * value;
+    };
+
+    auto pipeline = AConcurrent::pipeline(&pool, worker);
+
+    QList<int> input;
+    QList<int> expected;
+    for (int i = 0 ; i < 100 ; i++) {
+        input << i;
+        expected << i * i;
+    }
+
+    QList<QFuture<int>> futures = pipeline.add(input);
+    QCOMPARE(futures.size(), 100);
+    pipeline.close();
+
+    AConcurrent::await(pipeline.future());
+    QCOMPARE(pipeline.future().progressMaximum(), 100);
+    QVERIFY(pipeline.future().results() == expected);
+
+    for (int i = 0 ; i < 100 ; i++) {
+        QCOMPARE(futures[i].isFinished(), true);
+        QCOMPARE(futures[i].result(), i * i);
+    }
+
+    // The pipeline is closed
+    futures = pipeline.add(input);
+    Automator::wait(10);
+    QCOMPARE(futures[0].isCanceled(), true);
+}
+
+void AConcurrentTests::test_pipeline_result_order()
+{
+    // The first item is the slowest one
+    auto worker = [](int value) {
+        QThread::msleep(value == 0 ? 200 : 10);
+        return value * value;
+    };
+
+    QList<int> input;
+    for (int i = 0 ; i < 20 ; i++) {
+        input << i;
+    }
+
+    {
+        auto options = PipelineOptions().setResultOrder(PipelineOptions::UnorderedResults);
+        auto pipeline = AConcurrent::pipeline(&pool, worker, input, options);
+        pipeline.close();
+
+        AConcurrent::await(pipeline.future());
+        QList<int> results = pipeline.future().results();
+        QCOMPARE(results.size(), input.size());
+        QVERIFY(results.last() == 0);
+
+        for (int i = 0 ; i < results.size() ; i++) {
+            int source = pipeline.sourceIndexAt(i);
+            QCOMPARE(results[i], input[source] * input[source]);
+        }
+    }
+
+    {
+        // Results are released as contiguous runs
+        auto options = PipelineOptions().setResultOrder(PipelineOptions::StreamingOrderedResults).setReorderBufferSize(8);
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, options);
+
+        int released = 0;
+        bool contiguous = true;
+        QFutureWatcher<int> watcher;
+        connect(&watcher, &QFutureWatcher<int>::resultsReadyAt, [&](int begin, int end) {
+            contiguous = contiguous && begin == released;
+            released = end;
+        });
+        watcher.setFuture(future);
+
+        Automator::wait(100);
+        // The head is still running. Nothing is released and the dispatching is bounded by the buffer.
+        QCOMPARE(future.resultCount(), 0);
+        QVERIFY(future.progressValue() <= 8);
+
+        AConcurrent::await(future);
+        Automator::wait(10);
+        QCOMPARE(contiguous, true);
+        QCOMPARE(released, input.size());
+
+        QList<int> results = future.results();
+        for (int i = 0 ; i < input.size() ; i++) {
+            QCOMPARE(results[i], i * i);
+        }
+    }
+}
+
+void AConcurrentTests::test_pipeline_capacity()
+{
+    QSemaphore semaphore(0);
+
+    auto worker = [&](int value) {
+        semaphore.acquire();
+        return value;
+    };
+
+    {
+        auto pipeline = AConcurrent::pipeline(&pool, worker, PipelineOptions().setCapacity(2));
+
+        QFuture<int> f1, f2, f3;
+        QCOMPARE(pipeline.tryAdd(1, &f1), true);
+        QCOMPARE(pipeline.tryAdd(2, &f2), true);
+        QCOMPARE(pipeline.tryAdd(3, &f3), false);
+
+        QFuture<void> space = pipeline.spaceAvailable();
+        Automator::wait(50);
+        QCOMPARE(space.isFinished(), false);
+
+        semaphore.release(1);
+        AConcurrent::await(space, 1000);
+        QCOMPARE(space.isFinished(), true);
+        QCOMPARE(pipeline.tryAdd(3, &f3), true);
+
+        // A producer on a worker thread is blocked until there is space
+        QAtomicInt added;
+        auto producer = QtConcurrent::run([&]() {
+            pipeline.blockingAdd(4);
+            added.store(1);
+        });
+
+        Automator::wait(50);
+        QCOMPARE(added.load(), 0);
+
+        semaphore.release(1);
+        AConcurrent::await(producer, 1000);
+        QCOMPARE(added.load(), 1);
+
+        pipeline.close();
+        semaphore.release(2);
+        AConcurrent::await(pipeline.future());
+        QCOMPARE(pipeline.future().resultCount(), 4);
+    }
+
+    {
+        // Measure the cost by a function
+        auto pipeline = AConcurrent::pipeline(&pool, worker, PipelineOptions().setCapacity(100));
+        pipeline.setCostFunction([](const int& value) -> qint64 {
+            return value;
+        });
+
+        QCOMPARE(pipeline.tryAdd(60), true);
+        QCOMPARE(pipeline.tryAdd(50), false);
+        QCOMPARE(pipeline.tryAdd(40), true);
+
+        pipeline.close();
+        semaphore.release(2);
+        AConcurrent::await(pipeline.future());
+        QCOMPARE(pipeline.future().resultCount(), 2);
+    }
+
+    {
+        // The initial sequence is measured by the cost function too
+        auto pipeline = AConcurrent::pipeline(&pool, worker, QList<int>() << 30 << 40, PipelineOptions().setCapacity(100));
+        pipeline.setCostFunction([](const int& value) -> qint64 {
+            return value;
+        });
+
+        QCOMPARE(pipeline.tryAdd(40), false);
+        QCOMPARE(pipeline.tryAdd(30), true);
+
+        pipeline.close();
+        semaphore.release(3);
+        AConcurrent::await(pipeline.future());
+        QCOMPARE(pipeline.future().resultCount(), 3);
+    }
+}
+
+void AConcurrentTests::test_itemStore()
+{
+    AConcurrent::Private::ItemStore<int> store;
+    store.assign(QList<int>() << 0 << 1 << 2 << 3);
+    for (int i = 4 ; i < 8 ; i++) {
+        store.append(i);
+    }
+    QCOMPARE(store.size(), 8);
+
+    // Items finished out of order are released once the prefix before them is finished
+    store.finish(2, 3);
+    QCOMPARE(store.begin(), 0);
+    store.finish(0, 2);
+    QCOMPARE(store.begin(), 5);
+    QCOMPARE(store.at(5), 5);
+    QCOMPARE(store.at(7), 7);
+
+    store.append(8);
+    QCOMPARE(store.size(), 9);
+    QCOMPARE(store.at(8), 8);
+
+    store.finish(5, 4);
+    QCOMPARE(store.begin(), 9);
+    QCOMPARE(store.size(), 9);
+
+    AConcurrent::Private::ItemRecords<qint64> records;
+    records.append(1, 4);
+    records.release(3);
+    records.append(2);
+    QCOMPARE(records[3], Q_INT64_C(1));
+    QCOMPARE(records[4], Q_INT64_C(2));
+}
+
+void AConcurrentTests::test_pipeline_then()
+{
+    QAtomicInt writing;
+    QAtomicInt maxWriting;
+
+    auto decode = [](int value) {
+        return QString::number(value);
+    };
+
+    auto transform = [](QString value) {
+        return value + "!";
+    };
+
+    auto write = [&](QString value) {
+        int current = writing.fetchAndAddOrdered(1) + 1;
+        int max = maxWriting.load();
+        while (current > max && !maxWriting.testAndSetOrdered(max, current)) {
+            max = maxWriting.load();
+        }
+        QThread::msleep(5);
+        writing.fetchAndAddOrdered(-1);
+        return value.size();
+    };
+
+    QList<int> input;
+    for (int i = 0 ; i < 20 ; i++) {
+        input << i;
+    }
+
+    {
+        auto pipeline = AConcurrent::pipeline(&pool, decode, input).then(&pool, transform, 4).then(&pool, write, 1);
+
+        QFuture<int> last = pipeline.add(100);
+        pipeline.close();
+
+        AConcurrent::await(pipeline.future());
+        QCOMPARE(pipeline.future().isFinished(), true);
+        QCOMPARE(maxWriting.load(), 1);
+
+        // Results are reported at the index of their input
+        QList<int> results = pipeline.future().results();
+        QCOMPARE(results.size(), 21);
+        QCOMPARE(results[0], 2);
+        QCOMPARE(results[10], 3);
+        QCOMPARE(results[20], 4);
+        QCOMPARE(last.result(), 4);
+    }
+
+    {
+        // Canceling the future of the chain cancels every stage
+        QSemaphore semaphore(0);
+        auto pipeline = AConcurrent::pipeline(&pool, [&](int value) {
+            semaphore.acquire();
+            return value;
+        }, input);
+        auto chain = pipeline.then(&pool, [](int value) {
+            return value * 2;
+        }, 1);
+
+        chain.future().cancel();
+        semaphore.release(input.size());
+        QVERIFY(waitUntil([&]() {
+            return pipeline.future().isCanceled();
+        }, 1000));
+    }
+}
+
+void AConcurrentTests::test_workStealingExecutor()
+{
+    AConcurrent::WorkStealingExecutor executor(4);
+    QCOMPARE(executor.maxThreadCount(), 4);
+
+    QList<int> input;
+    for (int i = 0 ; i < 1000 ; i++) {
+        input << i;
+    }
+
+    auto square = [](int value) {
+        return value * value;
+    };
+
+    {
+        QFuture<int> future = AConcurrent::mapped(&executor, input, square);
+        AConcurrent::await(future);
+        QList<int> results = future.results();
+        QCOMPARE(results.size(), input.size());
+        QCOMPARE(results[999], 999 * 999);
+    }
+
+    {
+        QList<int> results = AConcurrent::blockingMapped(&executor, input, square, PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch));
+        QCOMPARE(results.size(), input.size());
+        QCOMPARE(results[10], 100);
+    }
+
+    {
+        // Functions started by a worker thread run on the same executor
+        QAtomicInt count;
+        QSemaphore done(0);
+        for (int i = 0 ; i < 10 ; i++) {
+            executor.start([&]() {
+                for (int j = 0 ; j < 10 ; j++) {
+                    executor.start([&]() {
+                        count.fetchAndAddOrdered(1);
+                        done.release();
+                    });
+                }
+            });
+        }
+        QVERIFY(done.tryAcquire(100, 5000));
+        QCOMPARE(count.load(), 100);
+    }
+
+    {
+        // The owner thread runs the newest function of its own deque first
+        AConcurrent::WorkStealingExecutor single(1);
+        QList<int> order;
+        QSemaphore done(0);
+        single.start([&]() {
+            for (int i = 0 ; i < 3 ; i++) {
+                single.start([&order, &done, i]() {
+                    order << i;
+                    done.release();
+                });
+            }
+        });
+        QVERIFY(done.tryAcquire(3, 5000));
+        QCOMPARE(order, QList<int>() << 2 << 1 << 0);
+    }
+}
+
+void AConcurrentTests::test_priority()
+{
+    {
+        QThreadPool singlePool;
+        singlePool.setMaxThreadCount(1);
+
+        QSemaphore semaphore(0);
+        QMutex mutex;
+        QList<int> order;
+
+        auto pipeline = AConcurrent::pipeline(&singlePool, [&](int value) {
+            if (value == 0) {
+                semaphore.acquire();
+            }
+            QMutexLocker locker(&mutex);
+            order << value;
+            return value;
+        });
+
+        // Block the pool by the first item
+        pipeline.add(0);
+        pipeline.add(1, 0);
+        pipeline.add(2, 0);
+        pipeline.add(3, 10);
+        pipeline.add(4, 5);
+        pipeline.close();
+
+        Automator::wait(50);
+        semaphore.release();
+        AConcurrent::await(pipeline.future());
+
+        QCOMPARE(order, QList<int>() << 0 << 3 << 4 << 1 << 2);
+    }
+
+    {
+        // A low priority item is not starved by a stream of high priority items
+        AConcurrent::Private::PendingQueue pending;
+        pending.enqueue(0, 1, 0);
+
+        int index, size, priority, effectivePriority;
+        int taken = -1;
+        for (int i = 1 ; i < 100 ; i++) {
+            pending.enqueue(i, 1, 1);
+            QVERIFY(pending.take(1, 1000, &index, &size, &priority, &effectivePriority));
+            if (index == 0) {
+                taken = i;
+                break;
+            }
+        }
+        QVERIFY(taken > 0);
+        // The queued priority is kept, but the aged one is used to run the task
+        QCOMPARE(priority, 0);
+        QVERIFY(effectivePriority >= 1);
+        QVERIFY(taken <= AConcurrent::Private::PendingQueue::AgingInterval + 1);
+    }
+}
+
+void AConcurrentTests::test_queue_maxInFlight()
+{
+    QAtomicInt running;
+    QAtomicInt maxRunning;
+
+    auto worker = [&](int value) {
+        int current = running.fetchAndAddOrdered(1) + 1;
+        int max = maxRunning.load();
+        while (current > max && !maxRunning.testAndSetOrdered(max, current)) {
+            max = maxRunning.load();
+        }
+        QThread::msleep(2);
+        running.fetchAndAddOrdered(-1);
+        return value * 2;
+    };
+
+    auto queue = AConcurrent::queue(&pool, worker, 2);
+
+    // Enqueue from worker threads
+    QList<QFuture<int>> futures;
+    QMutex mutex;
+    QList<int> producers;
+    producers << 0 << 1 << 2 << 3;
+    auto producer = QtConcurrent::map(producers, [&](int base) {
+        for (int i = 0 ; i < 10 ; i++) {
+            QFuture<int> future = queue.enqueue(base * 10 + i);
+            QMutexLocker locker(&mutex);
+            futures << future;
+        }
+    });
+    AConcurrent::await(producer);
+    QCOMPARE(futures.size(), 40);
+
+    for (int i = 0 ; i < futures.size() ; i++) {
+        AConcurrent::await(futures[i], 5000);
+        QCOMPARE(futures[i].isFinished(), true);
+    }
+
+    QList<int> results;
+    for (int i = 0 ; i < futures.size() ; i++) {
+        results << futures[i].result();
+    }
+    std::sort(results.begin(), results.end());
+    QCOMPARE(results.first(), 0);
+    QCOMPARE(results.last(), 78);
+    QVERIFY(maxRunning.load() <= 2);
+    QVERIFY(maxRunning.load() >= 1);
+}
+
+void AConcurrentTests::test_takeResults()
+{
+    QList<QByteArray> input;
+    for (int i = 0 ; i < 100 ; i++) {
+        input << QByteArray(1024, 'a' + i % 26);
+    }
+
+    // The worker takes the item by reference
+    auto worker = [](const QByteArray& value) {
+        return value.toUpper();
+    };
+
+    {
+        QFuture<QByteArray> future = AConcurrent::mapped(&pool, input, worker);
+        AConcurrent::await(future);
+
+        QVector<QByteArray> results = AConcurrent::takeResults(future);
+        QCOMPARE(results.size(), 100);
+        QCOMPARE(results[0], QByteArray(1024, 'A'));
+        QCOMPARE(results[27], QByteArray(1024, 'B'));
+    }
+
+    {
+        auto pipeline = AConcurrent::pipeline(&pool, worker, input);
+        pipeline.close();
+        AConcurrent::await(pipeline.future());
+
+        QVector<QByteArray> results = AConcurrent::takeResults(pipeline.future());
+        QCOMPARE(results.size(), 100);
+        QCOMPARE(results[99], QByteArray(1024, 'V'));
+    }
+
+    {
+        QFuture<QByteArray> future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch));
+        AConcurrent::await(future);
+        QCOMPARE(AConcurrent::takeResults(future).size(), 100);
+    }
+}
+
+void AConcurrentTests::test_mapped_batch_results()
+{
+    QList<int> input;
+    for (int i = 0 ; i < 1000 ; i++) {
+        input << i;
+    }
+
+    auto worker = [](int value) {
+        return value + 1;
+    };
+
+    {
+        // Ordered results of WorkerDispatch are published by batches of contiguous finished items
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch));
+
+        QFutureWatcher<int> watcher;
+        int published = 0;
+        bool contiguous = true;
+        connect(&watcher, &QFutureWatcher<int>::resultsReadyAt, [&](int begin, int end) {
+            contiguous = contiguous && begin == published;
+            published = end;
+        });
+        watcher.setFuture(future);
+
+        AConcurrent::await(future);
+        Automator::wait(10);
+        QCOMPARE(contiguous, true);
+        QCOMPARE(published, 1000);
+        QCOMPARE(future.resultAt(999), 1000);
+    }
+
+    {
+        // The finished prefix is published before the last item is finished
+        QSemaphore semaphore;
+        auto blocking = [&](int value) {
+            if (value == 999) {
+                semaphore.acquire();
+            }
+            return value + 1;
+        };
+
+        QFuture<int> future = AConcurrent::mapped(&pool, input, blocking, PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch));
+        QVERIFY(waitUntil([&]() {
+            return future.resultCount() == 999;
+        }, 2000));
+        QCOMPARE(future.isFinished(), false);
+
+        semaphore.release();
+        AConcurrent::await(future);
+        QCOMPARE(future.resultCount(), 1000);
+        QCOMPARE(future.resultAt(999), 1000);
+    }
+
+    {
+        // StreamingOrderedResults of WorkerDispatch reports the results in input order
+        auto options = PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch).setResultOrder(PipelineOptions::StreamingOrderedResults);
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, options);
+        AConcurrent::await(future);
+        QCOMPARE(future.resultCount(), 1000);
+        QCOMPARE(future.resultAt(0), 1);
+        QCOMPARE(future.resultAt(999), 1000);
+    }
+
+    {
+        // A chunk of a pipeline is published by a single batch
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setGrainSize(100));
+        AConcurrent::await(future);
+        QCOMPARE(future.resultCount(), 1000);
+        QCOMPARE(future.resultAt(500), 501);
+    }
+}
+
+void AConcurrentTests::test_pipeline_rateLimit()
+{
+    QList<int> input;
+    for (int i = 0 ; i < 20 ; i++) {
+        input << i;
+    }
+
+    auto worker = [](int value) {
+        return value;
+    };
+
+    // 100 items per second with a burst of 10 items: the first 10 items start at once, the rest take 100ms
+    QElapsedTimer timer;
+    timer.start();
+    QFuture<int> future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setRateLimit(100, 10));
+    AConcurrent::await(future);
+
+    QVERIFY(timer.elapsed() >= 90);
+    QCOMPARE(future.resultCount(), 20);
+    QCOMPARE(future.resultAt(19), 19);
+
+    // The limit is applied to WorkerDispatch too
+    timer.start();
+    future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setRateLimit(100, 10).setDispatchMode(PipelineOptions::WorkerDispatch));
+    AConcurrent::await(future);
+    QVERIFY(timer.elapsed() >= 90);
+    QCOMPARE(future.resultCount(), 20);
+}
+
+void AConcurrentTests::test_metrics()
+{
+    auto worker = [](int value) {
+        Automator::wait(5);
+        return value;
+    };
+
+    {
+        auto pipeline = AConcurrent::pipeline(&pool, worker);
+        QList<int> values;
+        for (int i = 0 ; i < 20 ; i++) {
+            values << i;
+        }
+        pipeline.add(values);
+        pipeline.close();
+        AConcurrent::await(pipeline.future());
+        Automator::wait(10);
+
+        // It could be read by any thread
+        Metrics metrics = QtConcurrent::run([&]() {
+            return pipeline.metrics();
+        }).result();
+
+        QCOMPARE(metrics.completed, Q_INT64_C(20));
+        QCOMPARE(metrics.queued, Q_INT64_C(0));
+        QCOMPARE(metrics.running, Q_INT64_C(0));
+        QVERIFY(metrics.finishedTasks > 0);
+        QVERIFY(metrics.throughput() > 0);
+
+        qint64 histogramTotal = 0;
+        for (int i = 0 ; i < metrics.executionTimeHistogram.size() ; i++) {
+            histogramTotal += metrics.executionTimeHistogram[i];
+        }
+        QCOMPARE(histogramTotal, Q_INT64_C(20));
+    }
+
+    {
+        auto queue = AConcurrent::queue(&pool, worker, 2);
+        QFuture<int> future;
+        for (int i = 0 ; i < 5 ; i++) {
+            future = queue.enqueue(i);
+        }
+        AConcurrent::await(future);
+        Automator::wait(50);
+
+        Metrics metrics = queue.metrics();
+        QCOMPARE(metrics.completed, Q_INT64_C(5));
+        QCOMPARE(metrics.queued, Q_INT64_C(0));
+        QVERIFY(metrics.averageWaitTime() > 0);
+    }
+}
+
+#if defined(ACONCURRENT_REQUIRE_COROUTINES) && !defined(ACONCURRENT_HAS_COROUTINES)
+#error "The compiler doesn't support coroutines"
+#endif
+
+#ifdef ACONCURRENT_HAS_COROUTINES
+static AConcurrent::Task<int> coroutineTask(QThreadPool* pool, QThread** workerThread) {
+    co_await AConcurrent::timeout(10);
+
+    int value = co_await AConcurrent::runOnMainThread([]() {
+        return 3;
+    });
+
+    QList<int> list = co_await AConcurrent::results(AConcurrent::mapped(pool, QList<int>() << 1 << 2, [](int value) {
+        return value * value;
+    }));
+
+    co_await AConcurrent::resumeOn(pool);
+    *workerThread = QThread::currentThread();
+
+    co_await AConcurrent::resumeOnMainThread();
+    co_return value + list[0] + list[1];
+}
+
+static AConcurrent::Task<int> canceledTask(QFuture<int> future, bool* resumed) {
+    int value = co_await future;
+    *resumed = true;
+    co_return value;
+}
+#endif
+
+void AConcurrentTests::test_coroutine()
+{
+#ifdef ACONCURRENT_HAS_COROUTINES
+    QThread* workerThread = nullptr;
+    auto task = coroutineTask(&pool, &workerThread);
+    QVERIFY(!task.future().isFinished());
+
+    await(task.future());
+    QCOMPARE(task.future().result(), 8);
+    QVERIFY(workerThread != nullptr);
+    QVERIFY(workerThread != QThread::currentThread());
+
+    {
+        // The task is canceled together with the awaited future, and the rest of the coroutine is not run
+        auto defer = AsyncFuture::deferred<int>();
+        bool resumed = false;
+        auto canceled = canceledTask(defer.future(), &resumed);
+        defer.cancel();
+
+        await(canceled.future(), 1000);
+        QVERIFY(canceled.future().isCanceled());
+        QCOMPARE(resumed, false);
+    }
+#else
+    QSKIP("Coroutines are not supported by the compiler");
+#endif
+}
+
+void AConcurrentTests::test_await_on_worker()
+{
+    QList<int> input;
+    for (int i = 0 ; i < 10 ; i++) {
+        input << i;
+    }
+
+    auto square = [](int value) {
+        return value * value;
+    };
+
+    {
+        // A single thread executor could not run the nested tasks unless the waiting worker helps
+        AConcurrent::WorkStealingExecutor executor(1);
+        auto defer = AsyncFuture::deferred<int>();
+
+        executor.start([&]() {
+            QList<int> result = AConcurrent::blockingMapped(&executor, input, square);
+            defer.complete(result.size());
+        });
+
+        await(defer.future(), 5000);
+        QVERIFY(defer.future().isFinished());
+        QCOMPARE(defer.future().result(), 10);
+    }
+
+    {
+        // The waiting worker of a full pool lets the pool start another thread
+        QThreadPool single;
+        single.setMaxThreadCount(1);
+        auto defer = AsyncFuture::deferred<int>();
+
+        AConcurrent::ExecutorRef executor(&single);
+        executor->start([&]() {
+            QList<int> result = AConcurrent::blockingMapped(&single, input, square);
+            defer.complete(result.size());
+        });
+
+        await(defer.future(), 5000);
+        QVERIFY(defer.future().isFinished());
+        QCOMPARE(defer.future().result(), 10);
+        single.waitForDone();
+    }
+}
+
+void AConcurrentTests::test_cancellationToken()
+{
+    QList<int> input;
+    for (int i = 0 ; i < 4 ; i++) {
+        input << i;
+    }
+
+    QAtomicInt stopped;
+
+    // It runs for 10 seconds unless it is canceled
+    auto worker = [&](int value, const AConcurrent::CancellationToken& token) {
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < 10000) {
+            if (token.isCanceled()) {
+                stopped.fetchAndAddOrdered(1);
+                break;
+            }
+            QThread::msleep(1);
+        }
+        return value;
+    };
+
+    QList<PipelineOptions> optionsList;
+    optionsList << PipelineOptions() << PipelineOptions().setDispatchMode(PipelineOptions::WorkerDispatch);
+
+    for (int i = 0 ; i < optionsList.size() ; i++) {
+        stopped.store(0);
+        QElapsedTimer timer;
+        timer.start();
+
+        QFuture<int> future = AConcurrent::mapped(&pool, input, worker, optionsList[i]);
+        Automator::wait(50);
+        future.cancel();
+
+        pool.waitForDone();
+        QVERIFY(timer.elapsed() < 5000);
+        QVERIFY(stopped.load() > 0);
+    }
+
+    {
+        // A worker without the token is still supported, and the token is never canceled by default
+        QVERIFY(!AConcurrent::CancellationToken().isCanceled());
+    }
+}
+
+void AConcurrentTests::test_hedging()
+{
+    QList<int> input;
+    for (int i = 0 ; i < 40 ; i++) {
+        input << i;
+    }
+
+    QAtomicInt slowStarted;
+    QAtomicInt slowStopped;
+
+    // The first run of item 35 is a straggler. It runs for 3 seconds unless it is canceled.
+    auto worker = [&](int value, const AConcurrent::CancellationToken& token) {
+        if (value == 35 && slowStarted.testAndSetOrdered(0, 1)) {
+            QElapsedTimer timer;
+            timer.start();
+            while (timer.elapsed() < 3000) {
+                if (token.isCanceled()) {
+                    slowStopped.store(1);
+                    break;
+                }
+                QThread::msleep(1);
+            }
+        } else {
+            QThread::msleep(5);
+        }
+        return value * 2;
+    };
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto pipeline = AConcurrent::pipeline(&pool, worker, input, PipelineOptions().setMaxConcurrency(4).setHedgingPercentile(0.9));
+    pipeline.close();
+    QFuture<int> future = pipeline.future();
+    AConcurrent::await(future);
+
+    QVERIFY(timer.elapsed() < 2000);
+    QCOMPARE(future.resultCount(), 40);
+    QCOMPARE(future.resultAt(35), 70);
+
+    pool.waitForDone();
+    QCOMPARE(slowStopped.load(), 1);
+
+    Metrics metrics = pipeline.metrics();
+    QVERIFY(metrics.hedged >= 1);
+    QVERIFY(metrics.hedgeWins >= 1);
+    QCOMPARE(metrics.completed, Q_INT64_C(40));
+}
+
+void AConcurrentTests::test_hedging_close()
+{
+    QAtomicInt slowStarted;
+
+    // The first run of item 35 ignores the token, so it is still running after its duplicate has won
+    auto worker = [&](int value) {
+        if (value == 35 && slowStarted.testAndSetOrdered(0, 1)) {
+            QThread::msleep(500);
+        } else {
+            QThread::msleep(5);
+        }
+        return value * 2;
+    };
+
+    auto pipeline = AConcurrent::pipeline(&pool, worker, PipelineOptions().setMaxConcurrency(4).setHedgingPercentile(0.9));
+    QList<int> input;
+    for (int i = 0 ; i < 40 ; i++) {
+        input << i;
+    }
+    pipeline.add(input);
+
+    QFuture<int> future = pipeline.future();
+    QVERIFY(waitUntil([&]() {
+        return future.progressValue() == 40;
+    }, 2000));
+    QCOMPARE(slowStarted.load(), 1);
+
+    // Close it while the losing copy is still running
+    pipeline.close();
+    AConcurrent::await(future, 3000);
+    QCOMPARE(future.isFinished(), true);
+    QCOMPARE(future.resultCount(), 40);
+    QCOMPARE(future.resultAt(35), 70);
+}
+
+void AConcurrentTests::test_adaptiveConcurrency()
+{
+    QList<int> input;
+    for (int i = 0 ; i < 200 ; i++) {
+        input << i;
+    }
+
+    QAtomicInt running;
+    QAtomicInt peak;
+
+    auto worker = [&](int value) {
+        int current = running.fetchAndAddOrdered(1) + 1;
+        int max = peak.load();
+        while (current > max && !peak.testAndSetOrdered(max, current)) {
+            max = peak.load();
+        }
+        QThread::msleep(2);
+        running.fetchAndAddOrdered(-1);
+        return value * 2;
+    };
+
+    auto future = AConcurrent::mapped(&pool, input, worker, PipelineOptions().setMaxConcurrency(3).setAdaptiveConcurrency(true));
+    AConcurrent::await(future);
+
+    QCOMPARE(future.resultCount(), 200);
+    QCOMPARE(future.resultAt(199), 398);
+    QVERIFY(peak.load() >= 1);
+    QVERIFY(peak.load() <= 3);
+}
+
+void AConcurrentTests::test_adaptiveLimit()
+{
+    AConcurrent::Private::AdaptiveLimit limit(true);
+    QCOMPARE(limit.value(8), 1);
+
+    // Slow start grows by 1 per finished task while saturated, so it doubles every round
+    limit.update(100, 1, 8);
+    QCOMPARE(limit.value(8), 2);
+    limit.update(100, 2, 8);
+    limit.update(100, 2, 8);
+    QCOMPARE(limit.value(8), 4);
+
+    // It doesn't grow below the limit
+    limit.update(100, 1, 8);
+    QCOMPARE(limit.value(8), 4);
+
+    // Cut by a quarter once the latency is doubled
+    limit.update(300, 4, 8);
+    QCOMPARE(limit.value(8), 3);
+
+    // At most once per round
+    limit.update(300, 3, 8);
+    limit.update(300, 3, 8);
+    QCOMPARE(limit.value(8), 3);
+    limit.update(300, 3, 8);
+    QCOMPARE(limit.value(8), 2);
+
+    // Bounded by the upper limit
+    AConcurrent::Private::AdaptiveLimit bounded(true);
+    for (int i = 0 ; i < 10 ; i++) {
+        bounded.update(100, 8, 3);
+    }
+    QCOMPARE(bounded.value(3), 3);
+}
+
+void AConcurrentTests::test_fairShareExecutor()
+{
+    QThreadPool single;
+    single.setMaxThreadCount(1);
+
+    AConcurrent::FairShareExecutor executor(&single);
+    AConcurrent::ExecutorRef bulk = executor.lane(1);
+    AConcurrent::ExecutorRef critical = executor.lane(3);
+
+    QSemaphore gate;
+    QMutex mutex;
+    QStringList order;
+
+    // Hold the only thread, so that all the functions below are queued in the lanes
+    executor.start([&]() {
+        gate.acquire();
+    });
+
+    for (int i = 0 ; i < 12 ; i++) {
+        bulk->start([&]() {
+            QMutexLocker locker(&mutex);
+            order << "bulk";
+        });
+    }
+
+    for (int i = 0 ; i < 12 ; i++) {
+        critical->start([&]() {
+            QMutexLocker locker(&mutex);
+            order << "critical";
+        });
+    }
+
+    gate.release();
+    QVERIFY(waitUntil([&]() {
+        QMutexLocker locker(&mutex);
+        return order.size() == 24;
+    }, 2000));
+    single.waitForDone();
+
+    // The critical lane takes 3 of every 4 threads while both lanes are busy
+    QCOMPARE(order.mid(0, 8).count("critical"), 6);
+    QCOMPARE(order.mid(8, 8).count("critical"), 6);
+    QCOMPARE(order.mid(16).count("critical"), 0);
+
+    auto pipeline = AConcurrent::pipeline(executor.lane(2), [](int value) {
+        return value * 2;
+    }, QList<int>() << 1 << 2 << 3);
+    pipeline.close();
+    auto future = pipeline.future();
+    AConcurrent::await(future);
+    QCOMPARE(future.results(), QList<int>() << 2 << 4 << 6);
+}
+
+void AConcurrentTests::test_asyncWorker()
+{
+    QThreadPool pool;
+    pool.setMaxThreadCount(2);
+
+    int outstanding = 0;
+    int peak = 0;
+
+    // It is called on the main thread and completes the future by a timer, so no thread is held
+    auto worker = [&](int value) {
+        auto defer = AsyncFuture::deferred<int>();
+        outstanding++;
+        peak = qMax(peak, outstanding);
+        QTimer::singleShot(50, [=, &outstanding]() mutable {
+            outstanding--;
+            defer.complete(value * 2);
+        });
+        return defer.future();
+    };
+
+    QList<int> input;
+    for (int i = 0 ; i < 200 ; i++) {
+        input << i;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto pipeline = AConcurrent::pipeline(&pool, worker, input, PipelineOptions().setMaxConcurrency(100));
+    auto stage = pipeline.then(&pool, [](int value) {
+        return QString::number(value);
+    });
+    stage.close();
+    QFuture<QString> future = stage.future();
+    AConcurrent::await(future);
+
+    QVERIFY(timer.elapsed() < 2000);
+    QCOMPARE(future.resultCount(), 200);
+    QCOMPARE(future.resultAt(199), QString("398"));
+    QCOMPARE(peak, 100);
+
+    // A canceled future cancels the pipeline
+    auto failed = AConcurrent::mapped(&pool, QList<int>() << 1 << 2 << 3, [](int value) {
+        auto defer = AsyncFuture::deferred<int>();
+        if (value == 2) {
+            defer.cancel();
+        } else {
+            defer.complete(value);
+        }
+        return defer.future();
+    });
+    AConcurrent::await(failed);
+    QCOMPARE(failed.isCanceled(), true);
+}
@@ -22,14 +22,30 @@ private slots:
 
     void test_mapped_progress();
 
+    void test_mapped_chunked();
+
+    void test_mapped_worker_dispatch();
+
     void test_blockingMapped();
 
+    void test_mappedReduced();
+
+    void test_filtered();
+
     void test_queue();
 
     void test_runOnMainThread();
 
+    void test_runOnMainThread_order();
+
+    void test_runOnMainThread_nested();
+
     void test_debounce();
 
+    void test_debounce_context();
+
+    void test_timerWheel();
+
     void test_pipeline();
 
     void test_pipeline_close();
@@ -46,6 +62,48 @@ private slots:
 
     void test_pipeline_dynamic_add();
 
+    void test_pipeline_add_list();
+
+    void test_pipeline_result_order();
+
+    void test_pipeline_capacity();
+
+    void test_itemStore();
+
+    void test_pipeline_then();
+
+    void test_workStealingExecutor();
+
+    void test_priority();
+
+    void test_queue_maxInFlight();
+
+    void test_takeResults();
+
+    void test_mapped_batch_results();
+
+    void test_pipeline_rateLimit();
+
+    void test_metrics();
+
+    void test_coroutine();
+
+    void test_await_on_worker();
+
+    void test_cancellationToken();
+
+    void test_hedging();
+
+    void test_hedging_close();
+
+    void test_adaptiveConcurrency();
+
+    void test_adaptiveLimit();
+
+    void test_fairShareExecutor();
+
+    void test_asyncWorker();
+
 private:
 
     QThreadPool pool;
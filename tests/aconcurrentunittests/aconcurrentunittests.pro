@@ -18,6 +18,7 @@ include(vendor/vendor.pri)
 include($$ROOTDIR/aconcurrent.pri)
 
 DISTFILES +=     qpm.json \    
+    aconcurrentunittests_cpp20.pro \
     ../../README.md \
     ../../qpm.json \
     ../../appveyor.yml
@@ -0,0 +1,14 @@
+# The unit tests built by C++20, so that the coroutine support is compiled and tested.
+# qmake aconcurrentunittests_cpp20.pro
+
+include(aconcurrentunittests.pro)
+
+TARGET = aconcurrent_cpp20
+
+CONFIG += c++2a
+
+# GCC 10 doesn't enable coroutines by -std=c++2a
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+
+# Fail the build instead of skipping test_coroutine if the compiler doesn't support coroutines
+DEFINES += ACONCURRENT_REQUIRE_COROUTINES